@@ -2,36 +2,85 @@
 
 #include <nano_pow/driver.hpp>
 #include <nano_pow/memory.hpp>
+#include <nano_pow/plat.hpp>
 #include <nano_pow/pow.hpp>
 #include <nano_pow/xoroshiro128starstar.hpp>
 
 #include <array>
+#include <chrono>
 #include <condition_variable>
 #include <functional>
 #include <mutex>
 #include <thread>
+#include <type_traits>
 #include <vector>
 
 namespace nano_pow
 {
+/*
+ * Non-owning reference to a callable taking (thread_id, total_threads)
+ *
+ * Unlike std::function it never allocates, the referenced callable must outlive its use
+ */
+class function_ref
+{
+public:
+	function_ref () = default;
+	template <typename F, typename = std::enable_if_t<!std::is_same<std::remove_cv_t<F>, function_ref>::value>>
+	function_ref (F & callable_a) :
+	object (&callable_a),
+	call ([](void * object_a, size_t thread_id_a, size_t total_threads_a) { (*static_cast<F *> (object_a)) (thread_id_a, total_threads_a); })
+	{
+	}
+	void operator() (size_t thread_id_a, size_t total_threads_a) const
+	{
+		call (object, thread_id_a, total_threads_a);
+	}
+	explicit operator bool () const
+	{
+		return call != nullptr;
+	}
+
+private:
+	void * object{ nullptr };
+	void (*call) (void *, size_t, size_t){ nullptr };
+};
 class thread_pool
 {
 public:
 	void resize (size_t);
 	void barrier ();
-	void execute (std::function<void(size_t, size_t)>);
+	// Runs `operation` once on every thread. It is referenced, not copied, and must outlive the next barrier
+	void execute (function_ref operation);
 	void stop ();
 	size_t size () const;
 
 private:
 	void loop (size_t thread_id);
+	// Threads at or above this index exit
+	size_t active{ 0 };
+	// Threads waiting for an operation
 	size_t ready{ 0 };
-	std::function<void(size_t, size_t)> operation;
-	std::vector<std::unique_ptr<std::thread>> threads;
+	// Incremented by execute, each thread runs the operation once per generation
+	uint64_t generation{ 0 };
+	function_ref operation;
+	std::vector<std::thread> threads;
 	std::condition_variable finish;
 	std::condition_variable start;
 	mutable std::mutex mutex;
 };
+/*
+ * Word size the cpp_driver search works on
+ *
+ * Difficulties of up to 64 bits only depend on the low word of the sum, so the 64 bit kernel keeps
+ * and adds only the low words of the hashes, checking the rare candidates on the full 128 bits
+ */
+enum class search_kernel
+{
+	AUTOMATIC,
+	WORD_64,
+	WORD_128
+};
 class cpp_driver : public driver
 {
 public:
@@ -41,9 +90,106 @@ public:
 	nano_pow::uint128_t difficulty_get () const override;
 	void threads_set (unsigned threads) override;
 	size_t threads_get () const override;
+	// Disables automatic memory sizing. Sizes up to memory_allocated_get () reuse the allocation
 	bool memory_set (size_t memory) override;
+	size_t memory_get () const override;
+	/*
+	 * Sizes the lookup table before each solve from the difficulty, the available memory
+	 * and the fill and search throughput measured by previous solves
+	 *
+	 * Enabled until memory_set is called. Solves throw std::runtime_error when not even the smallest table can be allocated
+	 */
+	void memory_auto_set (bool memory_auto);
+	bool memory_auto_get () const override;
+	// Memory automatic sizing picks for `difficulty_a`, in bytes
+	size_t memory_auto_size (nano_pow::uint128_t difficulty_a) const;
+	// Memory allocated, in bytes, of which memory_get () is in use
+	size_t memory_allocated_get () const;
+	// Gives the pages of the allocation past memory_get () back to the system, keeping the mapping
+	void memory_trim ();
+	/*
+	 * Largest table, in bytes, that fits in the memory available to the process with some to spare
+	 *
+	 * The table already allocated counts as available since it is released first. Returns true when availability is unknown
+	 */
+	bool memory_max (size_t & memory_a) const;
 	void memory_reset () override;
+	nano_pow::profile_key profile_key_get () const override;
 	std::array<uint64_t, 2> solve (std::array<uint64_t, 2> nonce) override;
+	nano_pow::solve_progress progress_get () const override;
+	// Resumes if the table can be used at the size it was filled for
+	std::array<uint64_t, 2> resume (std::array<uint64_t, 2> nonce, nano_pow::solve_progress const & progress) override;
+	/*
+	 * Solves several nonces at once at the current difficulty
+	 *
+	 * The table and the thread pool are split in up to `partitions_a` partitions, each with its own nonce and result.
+	 * Threads whose partition is solved help the others. Meant for batches of low difficulty requests
+	 * whose tables are small compared to the memory and threads available. Only batches that ran a single partition
+	 * last leave progress to resume, see progress_get
+	 *
+	 * @param partitions_a Most nonces solved together, 0 for as many as the threads and table allow
+	 * @return One solution per nonce, in order. Cancelled solutions are { 0, 0 }
+	 */
+	std::vector<std::array<uint64_t, 2>> solve_batch (std::vector<std::array<uint64_t, 2>> const & nonces_a, size_t partitions_a = 0);
+	// Number of hashes each thread computes between checks for cancellation and results
+	void stepping_set (uint32_t stepping) override;
+	uint32_t stepping_get () const override;
+	// Number of search attempts whose buckets are prefetched before any of them is read, 1 to max_prefetch
+	void prefetch_set (unsigned prefetch);
+	unsigned prefetch_get () const;
+	static unsigned constexpr max_prefetch{ 16 };
+	/*
+	 * Largest table, 2^36 entries or 256GB
+	 *
+	 * Solutions have a 32 bit lhs, so at most 2^32 pre-images are filled. Tables larger than 2^32 entries
+	 * keep more of them apart, about 1.4 times as many useful entries at 2^34, with no further gain beyond 2^36
+	 */
+	static unsigned constexpr max_lookup{ 36 };
+	/*
+	 * Touches every page of newly allocated tables from all threads so the first fill does not fault on each store
+	 *
+	 * Enabled by default, the time it took is reported by prefault_duration_get
+	 */
+	void prefault_set (bool prefault_a);
+	bool prefault_get () const;
+	// Duration of the last prefault, 0 if none
+	std::chrono::nanoseconds prefault_duration_get () const;
+	/*
+	 * Starts searching once `fraction_a` of the pre-images are filled, while the rest of the pool keeps filling
+	 *
+	 * Past that point each thread searches for about the share of the table already filled and fills otherwise,
+	 * so the pool shifts toward search as the fill progresses and a solution found early skips the rest of the fill.
+	 * Only fill threads take fill turns, threads that only search wait for the threshold. Applies to single nonce solves. 0, the default, fills completely before searching. Overlapped solves
+	 * do not measure the fill and search costs used by automatic memory sizing
+	 */
+	void overlap_set (double fraction_a);
+	double overlap_get () const;
+	/*
+	 * Threads of the pool used by the fill and by the search, 0 for all of them
+	 *
+	 * The fill is bound by random stores and may saturate memory bandwidth with fewer threads than the search,
+	 * which also hashes twice per attempt, can use. Counts above threads_get () use the whole pool
+	 */
+	void fill_threads_set (unsigned threads_a);
+	unsigned fill_threads_get () const;
+	void search_threads_set (unsigned threads_a);
+	unsigned search_threads_get () const;
+	/*
+	 * Processors the fill and search threads run on, the i-th thread of a phase on the i-th processor listed, wrapping around
+	 *
+	 * Empty lists, the default, leave threads to the scheduler. Threads are pinned again at the start of every phase
+	 */
+	void fill_affinity_set (std::vector<unsigned> const & cpus_a);
+	std::vector<unsigned> const & fill_affinity_get () const;
+	void search_affinity_set (std::vector<unsigned> const & cpus_a);
+	std::vector<unsigned> const & search_affinity_get () const;
+	// Search attempts made by all threads during the last search, readable while solving
+	uint64_t searched_get () const;
+	// AUTOMATIC picks the 64 bit kernel when the difficulty allows it. Either kernel finds valid solutions, forcing one is meant for benchmarks
+	void search_kernel_set (nano_pow::search_kernel kernel_a);
+	nano_pow::search_kernel search_kernel_get () const;
+	// Measured nanoseconds per search attempt across all threads, 0 until measured
+	double search_cost_get () const;
 	void dump () const override;
 	driver_type type () const override
 	{
@@ -51,6 +197,24 @@ public:
 	}
 
 private:
+	// Table region, nonce and result of one solution in progress
+	class partition
+	{
+	public:
+		std::array<uint64_t, 2> nonce{ { 0, 0 } };
+		uint32_t * slab{ nullptr };
+		size_t size{ 0 };
+		// Claimed by every filling thread
+		nano_pow::padded<std::atomic<uint64_t>> current{};
+		// Polled by every searching thread, written once
+		nano_pow::padded<std::array<std::atomic<uint64_t>, 2>> result{};
+	};
+	// Counters written by one thread only, published every `stepping` hashes
+	class thread_state
+	{
+	public:
+		std::atomic<uint64_t> searched{ 0 };
+	};
 	/*
 	 * Populates memory with `count` pre-images
 	 *
@@ -58,34 +222,79 @@ private:
 	 * basically does:
 	 *     slab_a[hash(x) % size_a] = x
 	 *
+	 * @param partition_a Table region and nonce to fill
 	 * @param count How many buckets to fill in slab_a
 	 * @param begin starting value to hash
 	 */
-	void fill_impl (uint64_t const count, uint64_t const begin = 0);
+	void fill_impl (partition & partition_a, uint64_t const count, uint64_t const begin = 0);
 	void fill () override;
 
 	/*
 	 * Searches for a solution to difficulty problem
 	 *
-	 * Generates `count` LHS hashes and searches for associated RHS hashes already in the slab
-	 *
-	 * @param count How many buckets to fill in slab_a
-	 * @param begin starting value to hash
+	 * Generates LHS hashes and searches for associated RHS hashes already in the slab
+	 * Starts with the partition of `thread_id` then helps the other partitions until all are solved
+	 * Partitions not completely filled are filled in turns with the search, see overlap_set
+	 * Hashes are summed and checked as `T`, uint64_t for difficulties of up to 64 bits, otherwise uint128_t
 	 */
+	template <typename T>
 	void search_impl (size_t thread_id);
 	std::array<uint64_t, 2> search () override;
-	std::atomic<uint64_t> current{ 0 };
-	static uint32_t constexpr stepping{ 1024 };
+	bool memory_allocate (size_t memory);
+	// Faults in `entries_a` entries of `slab_a`, each thread touching a contiguous range
+	void prefault (uint32_t * slab_a, size_t entries_a);
+	// Uses or allocates `memory`, or less if allocation fails, returns true on error
+	bool memory_auto_apply (size_t memory);
+	// Sets up a single partition over the table in use
+	void partition_single (std::array<uint64_t, 2> nonce, uint64_t const filled);
+	// Solves `nonce` from an empty table, within a solve already begun
+	std::array<uint64_t, 2> solve_fresh (std::array<uint64_t, 2> nonce);
+	// Solves the single partition, filling before or while searching
+	std::array<uint64_t, 2> solve_single ();
+	// Pool threads taking part in a phase limited to `threads_a`
+	size_t phase_threads (unsigned threads_a) const;
+	// Pins the calling pool thread for a phase with the given affinity
+	void phase_affinity (std::vector<unsigned> const & cpus_a, size_t thread_id) const;
+	bool memory_auto{ true };
+	// Measured nanoseconds per filled entry and per search attempt across all threads, 0 until measured
+	double fill_cost{ 0 };
+	double search_cost{ 0 };
+	// One per thread of the pool
+	std::vector<nano_pow::padded<thread_state>> thread_states;
+	static unsigned constexpr min_auto_lookup{ 10 };
+	static unsigned constexpr max_auto_lookup{ 32 };
+	// Threads are dealt to partitions round robin, so there are at most as many partitions as threads
+	std::vector<partition> partitions;
+	uint32_t stepping{ 1024 };
+	unsigned prefetch{ 1 };
+	bool prefault_enabled{ true };
+	double overlap{ 0 };
+	unsigned fill_threads{ 0 };
+	unsigned search_threads{ 0 };
+	std::vector<unsigned> fill_affinity;
+	std::vector<unsigned> search_affinity;
+	std::chrono::nanoseconds prefault_duration{ 0 };
+	nano_pow::search_kernel kernel{ nano_pow::search_kernel::AUTOMATIC };
 	thread_pool threads;
 	std::condition_variable condition;
 	mutable std::mutex mutex;
 	nano_pow::uint128_t difficulty_m;
+	// Low bits of the sum checked before the full comparison, as many as the leading ones of difficulty_m
 	nano_pow::uint128_t difficulty_inv;
-	uint64_t fill_count () const;
+	uint64_t fill_count (size_t const size_a) const;
+	/*
+	 * Entries in use, a prefix of the `allocated` entries
+	 *
+	 * The allocation is kept as an arena when smaller tables are set, so shrinking and growing back up
+	 * to it neither remaps nor faults the table again
+	 */
 	size_t size{ 0 };
+	size_t allocated{ 0 };
+	// Incremented whenever the table contents stop being those of the single solve last filled, see solve_progress::table
+	uint64_t table_generation{ 0 };
+	// Prefix of the allocation that may be faulted in, by prefault or by fills, since the last trim
+	size_t resident{ 0 };
 	std::unique_ptr<uint32_t, std::function<void(uint32_t *)>> slab{ nullptr, [](uint32_t *) {} };
-	std::atomic<uint64_t> result_0{ 0 };
-	std::atomic<uint64_t> result_1{ 0 };
 
 public:
 	std::array<uint64_t, 2> nonce{ { 0, 0 } };
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace nano_pow
+{
+// Processor brand string, "Unknown" when it cannot be read
+std::string cpu_model ();
+// Restricts the calling thread to the processors in `cpus_a`, or lifts the restriction when empty. Returns true on error
+bool thread_affinity_set (std::vector<unsigned> const & cpus_a);
+/*
+ * Processors this process can keep busy at once, returns true on error
+ *
+ * Those in its affinity mask, fewer under a cgroup CPU quota, which allows quota / period processors rounded up
+ */
+bool cpu_available (unsigned & cpus_a);
+// Scheduler throttling of the cgroup of this process under its CPU quota
+class cpu_throttling
+{
+public:
+	// Quota periods elapsed, and those in which the cgroup ran out of quota and was stopped
+	uint64_t periods{ 0 };
+	uint64_t throttled{ 0 };
+	// Total time the cgroup was stopped for
+	std::chrono::microseconds throttled_time{ 0 };
+};
+// Returns true when unknown, such as outside of a cgroup with the cpu controller
+bool cpu_throttling_get (nano_pow::cpu_throttling & throttling_a);
+// Threads to use by default, cpu_available when known and otherwise the hardware threads
+inline unsigned default_threads ()
+{
+	unsigned result{ 0 };
+	return nano_pow::cpu_available (result) ? std::thread::hardware_concurrency () : result;
+}
+}
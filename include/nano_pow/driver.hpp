@@ -1,5 +1,7 @@
 #pragma once
 
+#include <nano_pow/plat.hpp>
+#include <nano_pow/profile.hpp>
 #include <nano_pow/uint128.hpp>
 
 #include <array>
@@ -15,11 +17,38 @@ enum class driver_type
 	OPENCL
 };
 
+// Fill state of a cancelled solve, see driver::resume
+class solve_progress
+{
+public:
+	// Preimages already in the table
+	uint64_t filled{ 0 };
+	// Table entries they were filled for
+	size_t entries{ 0 };
+	// Nonce they were filled for
+	std::array<uint64_t, 2> nonce{ { 0, 0 } };
+	// Table contents they were filled into, changed by the driver whenever anything else uses or releases the table
+	uint64_t table{ 0 };
+};
 class driver
 {
 protected:
 	bool verbose{ false };
-	std::atomic<bool> cancel{ false };
+	// Polled by every solving thread, on cache lines of its own
+	nano_pow::padded<std::atomic<bool>> cancel{};
+	// Clears `cancel` as a solve starts, unless cancel_solve already targeted that solve. Called once at the start of every solve
+	void solve_begin ();
+	// Fills and searches until solved or cancelled
+	std::array<uint64_t, 2> solve_loop ();
+	// Solves started, the last one is running or done
+	std::atomic<uint64_t> solves{ 0 };
+	// Token passed to the last cancel_solve
+	std::atomic<uint64_t> cancelled_solve{ 0 };
+	// Applies the profile matching the current difficulty band, called by difficulty_set
+	void profile_apply ();
+	nano_pow::profiles profiles;
+	nano_pow::profile_key profile_hardware;
+	unsigned profile_applied_band{ ~0U };
 
 public:
 	virtual ~driver () = default;
@@ -35,21 +64,65 @@ public:
 	}
 	virtual void threads_set (unsigned threads) = 0;
 	virtual size_t threads_get () const = 0;
+	// Number of hashes each thread computes per batch
+	virtual void stepping_set (uint32_t stepping) = 0;
+	virtual uint32_t stepping_get () const = 0;
 	// Tell the driver the amount of memory to use, in bytes
-	// Value must be a power of 2
+	// Value must be a multiple of the 4 byte entry size
 	// Returns true on error
 	virtual bool memory_set (size_t memory) = 0;
+	// Memory in use, in bytes, 0 when none is allocated
+	virtual size_t memory_get () const = 0;
+	// Whether the memory is sized automatically for each solve
+	virtual bool memory_auto_get () const
+	{
+		return false;
+	}
 	// Free used memory
 	virtual void memory_reset () = 0;
+	// Hardware this driver runs on, with a band of 0
+	virtual nano_pow::profile_key profile_key_get () const = 0;
+	/*
+	 * Loads tuning profiles, see profile.hpp
+	 *
+	 * Drivers use no profile until one is loaded. When the difficulty enters a band with a matching profile
+	 * its threads and stepping are applied, and its memory if none is allocated and the size is not picked automatically
+	 * Returns true on error
+	 */
+	bool profile_load (std::string const & path);
+	void profile_disable ();
 	virtual void dump () const = 0;
 	virtual void fill () = 0;
 	virtual std::array<uint64_t, 2> search () = 0;
 	virtual std::array<uint64_t, 2> solve (std::array<uint64_t, 2> nonce) = 0;
+	// Fill state of the running or last solve
+	virtual nano_pow::solve_progress progress_get () const
+	{
+		return nano_pow::solve_progress ();
+	}
+	/*
+	 * Continues a cancelled solve of `nonce` from its fill state, skipping the preimages already filled
+	 *
+	 * Only possible while the table still holds them: once another solve used the table, or it was released,
+	 * the fill is redone from the start. Drivers that cannot resume solve from the start
+	 */
+	virtual std::array<uint64_t, 2> resume (std::array<uint64_t, 2> nonce, nano_pow::solve_progress const & progress)
+	{
+		(void)progress;
+		return solve (nonce);
+	}
 	virtual driver_type type () const = 0;
 	void cancel_current ()
 	{
-		cancel = true;
+		cancel.value = true;
+	}
+	// Names the next solve to start, for cancel_solve
+	uint64_t solve_token () const
+	{
+		return solves + 1;
 	}
+	// Cancels the solve named by `token_a` only, whether it is running or yet to start
+	void cancel_solve (uint64_t token_a);
 	void verbose_set (bool const v)
 	{
 		verbose = v;
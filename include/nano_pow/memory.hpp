@@ -5,7 +5,11 @@
 namespace nano_pow
 {
 bool memory_available (size_t &);
+// Physical memory installed, returns true on error
+bool memory_total (size_t &);
 void memory_init ();
 void free_page_memory (uint32_t * slab, size_t size);
+// Returns the pages fully within `size` entries from `begin` to the system, keeping them mapped with undefined content
+void discard_page_memory (uint32_t * begin, size_t size);
 uint32_t * alloc (size_t memory, bool & error);
 }
@@ -3,6 +3,7 @@
 #include <nano_pow/driver.hpp>
 #include <nano_pow/opencl.hpp>
 
+#include <chrono>
 #include <iostream>
 #include <vector>
 
@@ -101,12 +102,35 @@ public:
 	nano_pow::uint128_t difficulty_get () const override;
 	void threads_set (unsigned threads) override;
 	size_t threads_get () const override;
+	// Number of hashes each work-item computes per launch
+	void stepping_set (uint32_t stepping) override;
+	uint32_t stepping_get () const override;
 	size_t max_threads ();
+	// Largest memory, in whole megabytes, that fits the device global memory
+	size_t max_memory () const;
+	// Memory above the maximum allocation size is split across as many slabs as needed
 	bool memory_set (size_t memory) override;
+	size_t memory_get () const override;
 	void memory_reset () override;
+	nano_pow::profile_key profile_key_get () const override;
 	void fill () override;
 	std::array<uint64_t, 2> search () override;
 	std::array<uint64_t, 2> solve (std::array<uint64_t, 2> nonce) override;
+	/*
+	 * Adjusts stepping and the global size from measured search launch durations
+	 *
+	 * Launches are kept near target_launch: long enough to amortize launch overhead,
+	 * short enough to react quickly to cancellation and found solutions
+	 * Only search launches adapt, the fill keeps the threads and stepping set
+	 */
+	void adaptive_set (bool adaptive, std::chrono::milliseconds const target_launch = std::chrono::milliseconds (20));
+	bool adaptive_get () const;
+	// Use the fill kernel that bins writes in local memory before storing them
+	// Falls back to the direct fill when the device or thread count cannot run it
+	void fill_staged_set (bool staged);
+	bool fill_staged_get () const;
+	// Whether the device and the current thread count run the staged fill
+	bool fill_staged_runs () const;
 	void dump () const override;
 	driver_type type () const override
 	{
@@ -114,25 +138,57 @@ public:
 	}
 
 private:
+	/*
+	 * Creates the program for the selected device
+	 *
+	 * Program binaries are cached on disk, keyed by device, driver version and source hash
+	 * A missing or stale cache entry is rebuilt from source and written back
+	 *
+	 * @param slabs Number of slab buffers the kernels take
+	 * @return true if the program was loaded from the cache
+	 */
+	bool program_build (unsigned slabs);
+	// Builds the program and creates the kernels for `slabs` slab buffers
+	void kernels_build (unsigned slabs);
+	void launch_adapt (std::chrono::steady_clock::duration const launch);
 	opencl_environment environment;
 	cl::Context context;
 	cl::Program program;
 	uint32_t threads{ 8192 };
-	nano_pow::uint128_t difficulty;
-	nano_pow::uint128_t difficulty_inv;
-	std::vector<cl::Buffer> slabs{ 0 };
+	nano_pow::uint128_t difficulty{ 0 };
+	nano_pow::uint128_t difficulty_inv{ 0 };
+	std::vector<cl::Buffer> slabs;
 	uint64_t global_mem_size;
 	uint64_t max_alloc_size;
 	uint64_t slab_entries{ 0 };
 	uint64_t slab_size;
 	cl::Device selected_device;
 	cl::Kernel fill_impl{ 0 };
+	cl::Kernel fill_staged_impl{ 0 };
 	cl::Kernel search_impl{ 0 };
 	cl::CommandQueue queue;
 	cl::Buffer result_buffer{ 0 };
+	// Set by the first search work-item that claims the result
+	cl::Buffer found_buffer{ 0 };
 	cl::Buffer nonce_buffer{ 0 };
 	uint32_t stepping{ 256 };
+	// Search launch sizes, the set threads and stepping unless adapted
+	uint32_t search_threads{ 8192 };
+	uint32_t search_stepping{ 256 };
 	uint32_t current_fill{ 0 };
-	static unsigned constexpr max_slabs{ 4 };
+	bool adaptive{ false };
+	std::chrono::steady_clock::duration target_launch{ std::chrono::milliseconds (20) };
+	static uint32_t constexpr min_adaptive_threads{ 256 };
+	static uint32_t constexpr max_adaptive_threads{ 1 << 22 };
+	// Multiple of SEARCH_FOUND_CHECK in opencl_program.cl
+	static uint32_t constexpr min_adaptive_stepping{ 64 };
+	static uint32_t constexpr max_adaptive_stepping{ 1 << 16 };
+	bool fill_staged{ false };
+	bool fill_staged_supported{ false };
+	unsigned program_slabs{ 0 };
+	// Bounded by the device kernel parameter size
+	unsigned max_slabs{ 1 };
+	// Work-group size of the staged fill kernel, FILL_STAGE in opencl_program.cl
+	static unsigned constexpr fill_stage_size{ 256 };
 };
 }
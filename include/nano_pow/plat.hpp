@@ -9,3 +9,31 @@
 #ifndef NP_INLINE
 #define NP_INLINE
 #endif
+
+// Hint the processor to load the cache line holding address
+#ifdef _WIN32
+#include <xmmintrin.h>
+#define NP_PREFETCH(address) _mm_prefetch (reinterpret_cast<char const *> (address), _MM_HINT_T0)
+#else
+#define NP_PREFETCH(address) __builtin_prefetch (address)
+#endif
+
+#include <cstddef>
+
+namespace nano_pow
+{
+size_t constexpr cache_line_size{ 64 };
+/*
+ * Keeps `value` on cache lines of its own so writes to it do not contend with its neighbours
+ *
+ * Padding is used instead of alignas, over-aligned types are not honoured by operator new before C++17
+ */
+template <typename T>
+class padded
+{
+public:
+	char padding_before[cache_line_size];
+	T value;
+	char padding_after[cache_line_size];
+};
+}
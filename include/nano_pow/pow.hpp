@@ -17,6 +17,8 @@ nano_pow::uint128_t H1 (std::array<uint64_t, 2> nonce_a, uint64_t const item_a);
 nano_pow::uint128_t reverse (nano_pow::uint128_t const item_a);
 nano_pow::uint128_t bit_difficulty (unsigned bits_a);
 nano_pow::uint128_t bit_difficulty_64 (unsigned bits_a);
+// Number of leading one bits, the inverse of bit_difficulty
+unsigned difficulty_bits (nano_pow::uint128_t difficulty_a);
 nano_pow::uint128_t difficulty (std::array<uint64_t, 2> nonce_a, std::array<uint64_t, 2> const solution_a);
 bool passes (std::array<uint64_t, 2> nonce_a, std::array<uint64_t, 2> const solution_a, nano_pow::uint128_t difficulty_a);
 bool passes_64 (std::array<uint64_t, 2> nonce_a, std::array<uint64_t, 2> const solution_a, uint64_t difficulty_a);
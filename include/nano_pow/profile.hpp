@@ -0,0 +1,63 @@
+#pragma once
+
+#include <nano_pow/uint128.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace nano_pow
+{
+// Hardware and difficulty a tuning profile applies to
+class profile_key
+{
+public:
+	// "cpp" or "opencl"
+	std::string driver;
+	// CPU model or OpenCL device name
+	std::string device;
+	// Hardware threads or compute units
+	unsigned cores{ 0 };
+	// Total host or device memory, in MB
+	size_t memory{ 0 };
+	// See profile_band
+	unsigned band{ 0 };
+	bool operator== (profile_key const & other_a) const;
+};
+class profile
+{
+public:
+	profile_key key;
+	// Driver configuration, memory in bytes
+	size_t memory{ 0 };
+	size_t threads{ 0 };
+	uint32_t stepping{ 0 };
+};
+/*
+ * Tuning profiles stored as a versioned, tab separated text file
+ *
+ *     nano_pow_profiles <version>
+ *     <driver> <device> <cores> <memory MB> <band> <memory> <threads> <stepping>
+ *
+ * Files written by a different version are ignored
+ */
+class profiles
+{
+public:
+	static unsigned constexpr version{ 1 };
+	// Returns true on error, leaving the table empty
+	bool load (std::string const & path_a);
+	// Returns true on error
+	bool save (std::string const & path_a) const;
+	// Adds the profile, replacing any with the same key
+	void put (nano_pow::profile const & profile_a);
+	// nullptr if no profile matches
+	nano_pow::profile const * find (nano_pow::profile_key const & key_a) const;
+	std::vector<nano_pow::profile> entries;
+};
+// Difficulties are grouped in bands of 4 leading one bits
+unsigned profile_band (nano_pow::uint128_t difficulty_a);
+// NANO_POW_PROFILE if set, otherwise a file in the user's home directory
+std::string profile_default_path ();
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <nano_pow/work_cache.hpp>
+#include <nano_pow/work_queue.hpp>
+
+#include <atomic>
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace nano_pow
+{
+/*
+ * Work server answering newline delimited JSON requests over a loopback TCP or Unix domain socket
+ *
+ * Requests are objects with an "action" and an optional "id" echoed in the response:
+ *     {"action":"work_generate","id":1,"nonce":"<32 hex>","difficulty":"<16 or 32 hex>","priority":0,"timeout":1000}
+ *     {"action":"work_validate","nonce":"<32 hex>","work":"<32 hex>","difficulty":"<16 or 32 hex>"}
+ *     {"action":"work_cancel","nonce":"<32 hex>"}
+ *     {"action":"work_precompute","nonce":"<32 hex>","difficulty":"<16 or 32 hex>"}
+ * Nonces and work are two 64 bit words written one after the other. Responses are written as soon as they are ready,
+ * so several work_generate requests on one connection may be answered out of order.
+ * work_generate is answered from `cache_a` when it holds the work, work_precompute fills it in the background.
+ * work_cancel answers the connection's own work_generate requests for the nonce as cancelled, and a closed connection
+ * abandons those left. Their solves are only cancelled once no other connection or hint wants them.
+ * A connection has at most 256 work_generate requests unanswered, further ones are refused as "Too many requests"
+ */
+class server
+{
+public:
+	server (nano_pow::work_cache & cache_a);
+	~server ();
+	// Listens on 127.0.0.1, port 0 picks a free port. Returns true on error
+	bool listen_tcp (uint16_t port_a);
+	// Returns true on error
+	bool listen_unix (std::string const & path_a);
+	uint16_t port_get () const;
+	// Accepts connections until stopped
+	void start ();
+	void stop ();
+	// Requests of one connection
+	class session
+	{
+	public:
+		class generate
+		{
+		public:
+			std::array<uint64_t, 2> nonce{ { 0, 0 } };
+			// Response prefix with the request's id and action
+			std::string prefix;
+			std::shared_future<std::array<uint64_t, 2>> result;
+		};
+		// Wakes `waiter`, called by the cache as solves complete
+		void notify ();
+		// Called with each response line, from the connection's thread or `waiter`
+		std::function<void(std::string const &)> respond;
+		// Unanswered work_generate requests, taken out by whichever answers them first
+		std::list<generate> generates;
+		bool closed{ false };
+		uint64_t completions{ 0 };
+		std::mutex mutex;
+		std::condition_variable condition;
+		// Answers the work_generate requests as their solves complete
+		std::thread waiter;
+	};
+	// Answers one request line of `session_a`
+	void handle (std::string const & request_a, std::shared_ptr<session> const & session_a);
+	// Runs the waiter of `session_a` until closed
+	void wait (session & session_a);
+	// Abandons the work_generate requests of `session_a` still unanswered and joins its waiter
+	void close (session & session_a);
+
+private:
+	class connection
+	{
+	public:
+		int socket{ -1 };
+		std::thread thread;
+		std::atomic<bool> done{ false };
+	};
+	void accept_loop ();
+	void connection_loop (connection & connection_a);
+	nano_pow::work_cache & cache;
+	int listener{ -1 };
+	uint16_t port{ 0 };
+	std::string unix_path;
+	std::atomic<bool> stopped{ false };
+	std::thread acceptor;
+	std::list<std::unique_ptr<connection>> connections;
+};
+}
@@ -4,9 +4,54 @@
 #include <nano_pow/driver.hpp>
 #include <nano_pow/opencl_driver.hpp>
 
+#include <ostream>
+#include <vector>
+
 namespace nano_pow
 {
-size_t solve_many (nano_pow::driver & driver_a, size_t const count_a);
+size_t solve_many (nano_pow::driver & driver_a, size_t const count_a, uint64_t const first_nonce_a = 1);
+
+/*
+ * Configurations explored by the cpp_driver tuner
+ *
+ * By default each axis is tuned in turn, memory first, holding the others at the best values found so far and
+ * starting from the first value of each. With `joint` every combination is measured instead, which takes far longer.
+ * Configurations are measured `min_repeats` times, then those whose 95% confidence interval lies entirely above
+ * the interval of the current best are dropped, until one is left or `max_repeats` is reached
+ */
+class tune_space
+{
+public:
+	std::vector<size_t> threads;
+	// Threads used by the fill, 0 for all of them, combined with every thread count above it
+	std::vector<size_t> fill_threads{ 0 };
+	std::vector<size_t> memory;
+	std::vector<uint32_t> stepping;
+	std::vector<unsigned> prefetch;
+	unsigned min_repeats{ 2 };
+	unsigned max_repeats{ 5 };
+	bool joint{ false };
+};
+tune_space tune_space_default (size_t const initial_memory_a, size_t const initial_threads_a);
+
+class tune_result
+{
+public:
+	size_t threads{ 0 };
+	size_t fill_threads{ 0 };
+	size_t memory{ 0 };
+	uint32_t stepping{ 0 };
+	unsigned prefetch{ 0 };
+	// Average solution time of each repeat, in nanoseconds
+	std::vector<double> samples;
+	double mean () const;
+	// Half-width of the 95% confidence interval of the mean
+	double interval () const;
+	bool eliminated{ false };
+};
+// Writes `ranked_a` best first and leaves `driver_a` configured with the best result
+bool tune (cpp_driver & driver_a, unsigned const count_a, tune_space const & space_a, std::vector<tune_result> & ranked_a, std::ostream & stream);
+void tune_report (std::vector<tune_result> const & ranked_a, std::ostream & stream);
 
 bool tune (cpp_driver & driver_a, unsigned const count_a, size_t const initial_memory_a, size_t const initial_threads_a, size_t & best_memory_a);
 bool tune (cpp_driver & driver_a, unsigned const count_a, size_t const initial_memory_a, size_t const initial_threads_a, size_t & best_memory_a, std::ostream & stream);
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <nano_pow/work_queue.hpp>
+
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace nano_pow
+{
+// Hit and fill counters of a work_cache
+class work_cache_stats
+{
+public:
+	// Solves answered from the cache, and those queued
+	uint64_t hits{ 0 };
+	uint64_t misses{ 0 };
+	// Precompute hints queued, and those skipped because the work was cached or pending
+	uint64_t precomputes{ 0 };
+	uint64_t duplicates{ 0 };
+	// Entries dropped as least recently used
+	uint64_t evictions{ 0 };
+};
+/*
+ * Bounded cache of solutions over a work_queue, filled ahead of requests by precompute hints
+ *
+ * Clients request work for predictable nonces, such as the next block's root being the current frontier.
+ * Hints are solved in the background at priority 0 and solve requests run one priority above them, so hints only use
+ * otherwise idle time. Solutions are kept by nonce with the difficulty they achieve, the least recently used are dropped
+ * past `capacity`. The cache must be the only user of the queue while it runs
+ */
+class work_cache
+{
+public:
+	work_cache (nano_pow::work_queue & queue_a, size_t capacity_a = 4096);
+	// Abandons the solves still pending
+	~work_cache ();
+	// Solves `nonce_a` at `difficulty_a` in the background unless it is cached or pending at that difficulty or more
+	void precompute (std::array<uint64_t, 2> nonce_a, nano_pow::uint128_t difficulty_a);
+	/*
+	 * Solution for `nonce_a` reaching `difficulty_a`
+	 *
+	 * Ready at once if cached at that difficulty or more, otherwise queued at `priority_a` + 1.
+	 * Requests without a deadline join a pending solve for the nonce at that difficulty or more, promoting it to their priority.
+	 * See work_queue::push for the deadline and the results of failed solves
+	 *
+	 * @param complete_a Called from the cache's thread once the result is ready or the solve was cancelled,
+	 * unless the result is ready on return
+	 */
+	std::shared_future<std::array<uint64_t, 2>> solve (std::array<uint64_t, 2> nonce_a, nano_pow::uint128_t difficulty_a, unsigned priority_a = 0, nano_pow::work_queue::clock::time_point deadline_a = nano_pow::work_queue::clock::time_point::max (), std::function<void()> complete_a = nullptr);
+	/*
+	 * Releases one pending solve request for `nonce_a`, returns true if there was one
+	 *
+	 * The solves for the nonce are cancelled once no request or hint wants them anymore, a hint promoted by a request keeps its priority
+	 */
+	bool cancel (std::array<uint64_t, 2> nonce_a);
+	// Cached work for `nonce_a` reaching `difficulty_a`, returns true when found
+	bool find (std::array<uint64_t, 2> nonce_a, nano_pow::uint128_t difficulty_a, std::array<uint64_t, 2> & work_a);
+	// Entries cached
+	size_t size () const;
+	nano_pow::work_cache_stats stats_get () const;
+
+private:
+	class nonce_hash
+	{
+	public:
+		size_t operator() (std::array<uint64_t, 2> const & nonce_a) const;
+	};
+	class entry
+	{
+	public:
+		std::array<uint64_t, 2> nonce;
+		std::array<uint64_t, 2> work;
+		nano_pow::uint128_t difficulty;
+	};
+	class pending_solve
+	{
+	public:
+		std::array<uint64_t, 2> nonce;
+		nano_pow::uint128_t difficulty;
+		nano_pow::work_queue::clock::time_point deadline;
+		bool precompute;
+		std::shared_future<std::array<uint64_t, 2>> result;
+		// Solve requests waiting for the result and not released by cancel
+		unsigned requesters{ 0 };
+		// Completion callbacks of the requests
+		std::vector<std::function<void()>> waiters{};
+		// Abandoned, dropped without being waited for
+		bool cancelled{ false };
+	};
+	// Caches the results of pending solves as they complete
+	void run ();
+	// Completion callback for the solves queued
+	std::function<void()> notifier () const;
+	// Cancels the pending hints for `nonce_a` once the work cached answers all of them
+	void drop_hints (std::array<uint64_t, 2> nonce_a);
+	// Adds or improves the entry for `nonce_a`, making it the most recently used
+	void insert (std::array<uint64_t, 2> nonce_a, std::array<uint64_t, 2> work_a);
+	// Entry for `nonce_a` reaching `difficulty_a` moved to the front, or entries.end ()
+	std::list<entry>::iterator lookup (std::array<uint64_t, 2> nonce_a, nano_pow::uint128_t difficulty_a);
+	nano_pow::work_queue & queue;
+	size_t capacity;
+	// Most recently used first
+	std::list<entry> entries;
+	std::unordered_map<std::array<uint64_t, 2>, std::list<entry>::iterator, nonce_hash> index;
+	// Solves queued or running, oldest first
+	std::deque<pending_solve> pending;
+	nano_pow::work_cache_stats stats;
+	bool stopped{ false };
+	// Wakes run when a solve completes or pending changes, shared with the completion callbacks of the queue
+	class signal
+	{
+	public:
+		void notify ();
+		std::mutex mutex;
+		std::condition_variable condition;
+		uint64_t count{ 0 };
+	};
+	std::shared_ptr<signal> completions{ std::make_shared<signal> () };
+	mutable std::mutex mutex;
+	std::thread thread;
+};
+}
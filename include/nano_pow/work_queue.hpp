@@ -0,0 +1,119 @@
+#pragma once
+
+#include <nano_pow/driver.hpp>
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace nano_pow
+{
+// Latency and outcome counters of the jobs of one priority
+class work_queue_stats
+{
+public:
+	uint64_t solved{ 0 };
+	uint64_t expired{ 0 };
+	uint64_t cancelled{ 0 };
+	// Solves that threw or returned no solution on their own
+	uint64_t failed{ 0 };
+	// Times a job of this priority was preempted by a more urgent one
+	uint64_t preempted{ 0 };
+	// From push to the first start of the job
+	uint64_t started{ 0 };
+	std::chrono::nanoseconds queue_total{ 0 };
+	std::chrono::nanoseconds queue_max{ 0 };
+	// From push to the solution of the job
+	std::chrono::nanoseconds service_total{ 0 };
+	std::chrono::nanoseconds service_max{ 0 };
+	std::chrono::nanoseconds queue_mean () const;
+	std::chrono::nanoseconds service_mean () const;
+};
+/*
+ * Schedules solves on a driver by priority then deadline
+ *
+ * A job pushed with a higher priority than the running one preempts it through driver::cancel_current.
+ * Preempted jobs are queued again and later continued with driver::resume, which refills the table when the jobs run in between used it.
+ * The queue must be the only user of the driver while it runs
+ */
+class work_queue
+{
+public:
+	using clock = std::chrono::steady_clock;
+	work_queue (nano_pow::driver & driver_a);
+	~work_queue ();
+	/*
+	 * Queues a solve of `nonce_a` at `difficulty_a`
+	 *
+	 * Higher priorities run first. Jobs still unsolved at `deadline_a` are abandoned
+	 *
+	 * @param complete_a Called once the result is set, from a thread of the queue without its lock held.
+	 * Not called when the queue is already stopped, the result is then ready on return
+	 * @return The solution, { 0, 0 } if the job expired, was cancelled or the queue stopped.
+	 * Exceptions thrown by the driver are passed on
+	 */
+	std::future<std::array<uint64_t, 2>> push (std::array<uint64_t, 2> nonce_a, nano_pow::uint128_t difficulty_a, unsigned priority_a = 0, clock::time_point deadline_a = clock::time_point::max (), std::function<void()> complete_a = nullptr);
+	// Abandons the queued or running jobs for `nonce_a`, returns true if there were any
+	bool cancel (std::array<uint64_t, 2> nonce_a);
+	/*
+	 * Raises the queued or running jobs for `nonce_a` to at least `priority_a`, returns true if there were any
+	 *
+	 * A queued job promoted above the running one preempts it. Jobs are counted in the stats of the priority they finish at
+	 */
+	bool promote (std::array<uint64_t, 2> nonce_a, unsigned priority_a);
+	// Abandons every job and stops dispatching
+	void stop ();
+	// Jobs queued or running
+	size_t size () const;
+	std::map<unsigned, nano_pow::work_queue_stats> stats_get () const;
+
+private:
+	class job
+	{
+	public:
+		std::array<uint64_t, 2> nonce;
+		nano_pow::uint128_t difficulty;
+		unsigned priority;
+		clock::time_point deadline;
+		clock::time_point pushed;
+		uint64_t sequence;
+		bool started{ false };
+		bool cancelled{ false };
+		nano_pow::solve_progress progress;
+		std::promise<std::array<uint64_t, 2>> promise;
+		std::function<void()> complete;
+	};
+	void run ();
+	// Cancels the running job when it expires, is cancelled or preempted
+	void watch ();
+	// Returns the most urgent queued job, removing it
+	std::shared_ptr<job> pop ();
+	void finish (job & job_a, std::array<uint64_t, 2> const & result_a);
+	// Queues the completion callback of `job_a`, whose result was just set
+	void completed (job & job_a);
+	// Runs the queued completion callbacks, releasing `lock_a` meanwhile. Returns true if there were any
+	bool notify (std::unique_lock<std::mutex> & lock_a);
+	nano_pow::driver & driver;
+	std::vector<std::shared_ptr<job>> queue;
+	std::shared_ptr<job> running;
+	// Driver solve token of the running job
+	uint64_t running_token{ 0 };
+	bool preempt{ false };
+	bool stopped{ false };
+	uint64_t sequence{ 0 };
+	std::map<unsigned, nano_pow::work_queue_stats> stats;
+	std::vector<std::function<void()>> completions;
+	std::condition_variable condition;
+	mutable std::mutex mutex;
+	std::thread dispatcher;
+	std::thread watchdog;
+};
+}
@@ -0,0 +1,211 @@
+#include <nano_pow/cpu.hpp>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#ifdef __APPLE__
+#include <sys/sysctl.h>
+#else
+#include <sched.h>
+#endif
+
+namespace
+{
+// Directories holding the cpu controller files of this process cgroup, v2 then v1, those that exist
+std::vector<std::pair<std::string, bool>> cgroup_cpu_directories ()
+{
+	std::vector<std::pair<std::string, bool>> result;
+	std::ifstream cgroups ("/proc/self/cgroup");
+	std::string line;
+	while (std::getline (cgroups, line))
+	{
+		// Lines are "hierarchy:controllers:path"
+		auto first (line.find (':'));
+		auto second (line.find (':', first + 1));
+		if (first != std::string::npos && second != std::string::npos)
+		{
+			auto controllers (line.substr (first + 1, second - first - 1));
+			auto path (line.substr (second + 1));
+			// Inside a cgroup namespace the paths are relative to the mount, so the mount root is tried too
+			if (line.compare (0, first, "0") == 0 && controllers.empty ())
+			{
+				result.emplace_back ("/sys/fs/cgroup" + path, true);
+				result.emplace_back ("/sys/fs/cgroup", true);
+			}
+			else if (("," + controllers + ",").find (",cpu,") != std::string::npos)
+			{
+				result.emplace_back ("/sys/fs/cgroup/cpu" + path, false);
+				result.emplace_back ("/sys/fs/cgroup/cpu", false);
+			}
+		}
+	}
+	result.erase (std::remove_if (result.begin (), result.end (), [](std::pair<std::string, bool> const & directory_a) {
+		return !std::ifstream (directory_a.first + (directory_a.second ? "/cpu.max" : "/cpu.cfs_quota_us"));
+	}),
+	result.end ());
+	return result;
+}
+
+// Processors allowed by the cgroup CPU quota rounded up, returns true when there is no quota
+bool cgroup_quota (unsigned & cpus_a)
+{
+	bool error{ true };
+	for (auto const & directory : cgroup_cpu_directories ())
+	{
+		long long quota{ -1 };
+		long long period{ 0 };
+		if (directory.second)
+		{
+			// "max 100000" when unlimited, which fails to read as a number
+			std::ifstream file (directory.first + "/cpu.max");
+			file >> quota >> period;
+		}
+		else
+		{
+			// -1 when unlimited
+			std::ifstream (directory.first + "/cpu.cfs_quota_us") >> quota;
+			std::ifstream (directory.first + "/cpu.cfs_period_us") >> period;
+		}
+		if (error && quota > 0 && period > 0)
+		{
+			cpus_a = static_cast<unsigned> (std::max (1LL, (quota + period - 1) / period));
+			error = false;
+		}
+	}
+	return error;
+}
+}
+
+namespace nano_pow
+{
+std::string cpu_model ()
+{
+	std::string result;
+#ifdef __APPLE__
+	char buffer[256]{ 0 };
+	size_t size (sizeof (buffer) - 1);
+	if (sysctlbyname ("machdep.cpu.brand_string", buffer, &size, nullptr, 0) == 0)
+	{
+		result = buffer;
+	}
+#else
+	std::ifstream cpuinfo ("/proc/cpuinfo");
+	std::string line;
+	while (result.empty () && std::getline (cpuinfo, line))
+	{
+		// x86 reports "model name", some ARM kernels only "Processor"
+		if (line.compare (0, 10, "model name") == 0 || line.compare (0, 9, "Processor") == 0)
+		{
+			auto value (line.find_first_not_of (" \t", line.find (':') + 1));
+			if (line.find (':') != std::string::npos && value != std::string::npos)
+			{
+				result = line.substr (value);
+			}
+		}
+	}
+#endif
+	return result.empty () ? "Unknown" : result;
+}
+
+bool thread_affinity_set (std::vector<unsigned> const & cpus_a)
+{
+#ifdef __APPLE__
+	// Only affinity hints are available, threads cannot be pinned
+	return !cpus_a.empty ();
+#else
+	// Lifting the restriction returns to the processors the process started with
+	static cpu_set_t const initial = []() {
+		cpu_set_t result;
+		CPU_ZERO (&result);
+		if (sched_getaffinity (0, sizeof (result), &result) != 0)
+		{
+			for (unsigned cpu (0); cpu < CPU_SETSIZE; ++cpu)
+			{
+				CPU_SET (cpu, &result);
+			}
+		}
+		return result;
+	}();
+	cpu_set_t set (initial);
+	if (!cpus_a.empty ())
+	{
+		CPU_ZERO (&set);
+		for (auto cpu : cpus_a)
+		{
+			if (cpu >= CPU_SETSIZE)
+			{
+				return true;
+			}
+			CPU_SET (cpu, &set);
+		}
+	}
+	return sched_setaffinity (0, sizeof (set), &set) != 0;
+#endif
+}
+
+bool cpu_available (unsigned & cpus_a)
+{
+#ifdef __APPLE__
+	// Processes cannot be restricted to some processors
+	cpus_a = std::thread::hardware_concurrency ();
+	bool error{ false };
+#else
+	cpu_set_t set;
+	CPU_ZERO (&set);
+	bool error (sched_getaffinity (0, sizeof (set), &set) != 0);
+	cpus_a = error ? 0 : static_cast<unsigned> (CPU_COUNT (&set));
+#endif
+	unsigned quota{ 0 };
+	if (!error && !cgroup_quota (quota))
+	{
+		cpus_a = std::min (cpus_a, quota);
+	}
+	return error || cpus_a == 0;
+}
+
+bool cpu_throttling_get (nano_pow::cpu_throttling & throttling_a)
+{
+	bool error{ true };
+	for (auto const & directory : cgroup_cpu_directories ())
+	{
+		std::ifstream file (directory.first + "/cpu.stat");
+		std::string line;
+		nano_pow::cpu_throttling throttling;
+		unsigned fields{ 0 };
+		while (std::getline (file, line))
+		{
+			std::istringstream stream (line);
+			std::string key;
+			unsigned long long value{ 0 };
+			if (stream >> key >> value)
+			{
+				fields += key == "nr_periods" || key == "nr_throttled" || key == "throttled_usec" || key == "throttled_time";
+				if (key == "nr_periods")
+				{
+					throttling.periods = value;
+				}
+				else if (key == "nr_throttled")
+				{
+					throttling.throttled = value;
+				}
+				else if (key == "throttled_usec")
+				{
+					throttling.throttled_time = std::chrono::microseconds (value);
+				}
+				else if (key == "throttled_time")
+				{
+					// cgroup v1 counts nanoseconds
+					throttling.throttled_time = std::chrono::duration_cast<std::chrono::microseconds> (std::chrono::nanoseconds (value));
+				}
+			}
+		}
+		if (error && fields == 3)
+		{
+			throttling_a = throttling;
+			error = false;
+		}
+	}
+	return error;
+}
+}
@@ -1,19 +1,194 @@
 #include <nano_pow/memory.hpp>
 #include <nano_pow/pow.hpp>
 
+#include <algorithm>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <string>
+
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
 
 #ifndef MAP_NOCACHE
 /* No MAP_NOCACHE on Linux */
 #define MAP_NOCACHE (0)
 #endif
 
+namespace
+{
+// Limits at or above this are how cgroup v1 spells unlimited
+size_t constexpr cgroup_unlimited{ 1ULL << 60 };
+
+// First whitespace separated number in `path_a`, returns true on error
+bool read_number (std::string const & path_a, size_t & value_a)
+{
+	std::ifstream file (path_a);
+	unsigned long long value{ 0 };
+	bool error (!(file >> value));
+	if (!error)
+	{
+		value_a = static_cast<size_t> (value);
+	}
+	return error;
+}
+
+// Value in bytes of `key_a` in a "key value" file such as memory.stat, or "key: value kB" for /proc/meminfo
+bool read_field (std::string const & path_a, std::string const & key_a, size_t & value_a)
+{
+	std::ifstream file (path_a);
+	bool error{ true };
+	std::string line;
+	while (error && std::getline (file, line))
+	{
+		std::istringstream stream (line);
+		std::string key;
+		unsigned long long value{ 0 };
+		std::string unit;
+		if (stream >> key >> value && (key == key_a || key == key_a + ":"))
+		{
+			stream >> unit;
+			value_a = static_cast<size_t> (unit == "kB" ? value * 1024 : value);
+			error = false;
+		}
+	}
+	return error;
+}
+
+/*
+ * Memory left under the cgroup limit of this process, v2 then v1, returns true when there is no limit
+ *
+ * Page cache counted in the usage is reclaimable, so inactive file pages are not counted as used
+ */
+bool cgroup_available (size_t & memory_a)
+{
+	std::ifstream cgroups ("/proc/self/cgroup");
+	std::string v2_path;
+	std::string v1_path;
+	std::string line;
+	while (std::getline (cgroups, line))
+	{
+		// Lines are "hierarchy:controllers:path"
+		auto first (line.find (':'));
+		auto second (line.find (':', first + 1));
+		if (first != std::string::npos && second != std::string::npos)
+		{
+			auto controllers (line.substr (first + 1, second - first - 1));
+			auto path (line.substr (second + 1));
+			if (line.compare (0, first, "0") == 0 && controllers.empty ())
+			{
+				v2_path = path;
+			}
+			else if (("," + controllers + ",").find (",memory,") != std::string::npos)
+			{
+				v1_path = path;
+			}
+		}
+	}
+	bool error{ true };
+	size_t limit{ 0 };
+	size_t usage{ 0 };
+	size_t inactive{ 0 };
+	// Inside a cgroup namespace the paths are relative to the mount, so the mount root is tried too
+	for (auto const & directory : { "/sys/fs/cgroup" + v2_path, std::string ("/sys/fs/cgroup") })
+	{
+		if (error && !v2_path.empty () && !read_number (directory + "/memory.max", limit) && !read_number (directory + "/memory.current", usage))
+		{
+			read_field (directory + "/memory.stat", "inactive_file", inactive);
+			error = false;
+		}
+	}
+	for (auto const & directory : { "/sys/fs/cgroup/memory" + v1_path, std::string ("/sys/fs/cgroup/memory") })
+	{
+		if (error && !v1_path.empty () && !read_number (directory + "/memory.limit_in_bytes", limit) && !read_number (directory + "/memory.usage_in_bytes", usage))
+		{
+			read_field (directory + "/memory.stat", "total_inactive_file", inactive);
+			error = false;
+		}
+	}
+	// memory.max holds "max" when unlimited, which fails to read as a number
+	error |= limit >= cgroup_unlimited;
+	if (!error)
+	{
+		usage -= std::min (usage, inactive);
+		memory_a = limit - std::min (limit, usage);
+	}
+	return error;
+}
+
+// Address space left under RLIMIT_AS, returns true when there is no limit
+bool address_space_available (size_t & memory_a)
+{
+	rlimit limit;
+	bool error (getrlimit (RLIMIT_AS, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY);
+	if (!error)
+	{
+		size_t used{ 0 };
+		size_t pages{ 0 };
+		auto page_size (sysconf (_SC_PAGE_SIZE));
+		// First field of statm is the virtual size in pages
+		if (page_size > 0 && !read_number ("/proc/self/statm", pages))
+		{
+			used = pages * static_cast<size_t> (page_size);
+		}
+		auto cap (static_cast<size_t> (std::min<unsigned long long> (limit.rlim_cur, std::numeric_limits<size_t>::max ())));
+		memory_a = cap - std::min (cap, used);
+	}
+	return error;
+}
+}
+
 namespace nano_pow
 {
-bool memory_available (size_t & /* memory */)
+/*
+ * Smallest of the memory available to the system, the cgroup limit and the address space limit
+ *
+ * Returns true when none of them could be read
+ */
+bool memory_available (size_t & memory)
 {
-	// Unavailable
-	return true;
+	size_t system{ 0 };
+	bool error (read_field ("/proc/meminfo", "MemAvailable", system));
+#ifdef _SC_AVPHYS_PAGES
+	if (error)
+	{
+		// Before Linux 3.14 and on other systems, free memory underestimates what could be reclaimed
+		auto pages (sysconf (_SC_AVPHYS_PAGES));
+		auto page_size (sysconf (_SC_PAGE_SIZE));
+		error = pages <= 0 || page_size <= 0;
+		system = error ? 0 : static_cast<size_t> (pages) * static_cast<size_t> (page_size);
+	}
+#endif
+	auto result (error ? std::numeric_limits<size_t>::max () : system);
+	size_t limited{ 0 };
+	if (!cgroup_available (limited))
+	{
+		result = std::min (result, limited);
+		error = false;
+	}
+	if (!address_space_available (limited))
+	{
+		result = std::min (result, limited);
+		error = false;
+	}
+	if (!error)
+	{
+		memory = result;
+	}
+	return error;
+}
+
+bool memory_total (size_t & memory)
+{
+	auto pages (sysconf (_SC_PHYS_PAGES));
+	auto page_size (sysconf (_SC_PAGE_SIZE));
+	bool error (pages <= 0 || page_size <= 0);
+	if (!error)
+	{
+		memory = static_cast<size_t> (pages) * static_cast<size_t> (page_size);
+	}
+	return error;
 }
 
 void memory_init ()
@@ -28,6 +203,22 @@ void free_page_memory (uint32_t * slab, size_t size)
 		munmap (slab, size * 4);
 	}
 }
+void discard_page_memory (uint32_t * begin, size_t size)
+{
+	auto page (static_cast<uintptr_t> (sysconf (_SC_PAGE_SIZE)));
+	auto first ((reinterpret_cast<uintptr_t> (begin) + page - 1) / page * page);
+	auto last (reinterpret_cast<uintptr_t> (begin + size) / page * page);
+	if (last > first)
+	{
+#ifdef __APPLE__
+		// MADV_DONTNEED does not release anonymous pages on macOS
+		madvise (reinterpret_cast<void *> (first), last - first, MADV_FREE);
+#else
+		madvise (reinterpret_cast<void *> (first), last - first, MADV_DONTNEED);
+#endif
+	}
+}
+
 uint32_t * alloc (size_t memory, bool & error)
 {
 	auto alloc = mmap (0, memory, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE | MAP_NOCACHE, -1, 0);
@@ -0,0 +1,84 @@
+#include <nano_pow/cpu.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#include <intrin.h>
+
+#define NOMINMAX
+#include <windows.h>
+
+namespace nano_pow
+{
+std::string cpu_model ()
+{
+	std::string result;
+	std::array<int, 4> registers;
+	__cpuid (registers.data (), 0x80000000);
+	if (static_cast<unsigned> (registers[0]) >= 0x80000004)
+	{
+		char brand[49]{ 0 };
+		for (unsigned i{ 0 }; i < 3; ++i)
+		{
+			__cpuid (registers.data (), 0x80000002 + i);
+			std::memcpy (brand + i * sizeof (registers), registers.data (), sizeof (registers));
+		}
+		result = brand;
+		auto begin (result.find_first_not_of (' '));
+		result = begin != std::string::npos ? result.substr (begin) : "";
+	}
+	return result.empty () ? "Unknown" : result;
+}
+
+bool thread_affinity_set (std::vector<unsigned> const & cpus_a)
+{
+	DWORD_PTR process_mask;
+	DWORD_PTR system_mask;
+	if (!GetProcessAffinityMask (GetCurrentProcess (), &process_mask, &system_mask))
+	{
+		return true;
+	}
+	// Processors past the first group of 64 cannot be selected with a single mask
+	DWORD_PTR mask (cpus_a.empty () ? process_mask : 0);
+	for (auto cpu : cpus_a)
+	{
+		if (cpu >= sizeof (DWORD_PTR) * 8)
+		{
+			return true;
+		}
+		mask |= static_cast<DWORD_PTR> (1) << cpu;
+	}
+	return SetThreadAffinityMask (GetCurrentThread (), mask) == 0;
+}
+
+bool cpu_available (unsigned & cpus_a)
+{
+	DWORD_PTR process_mask;
+	DWORD_PTR system_mask;
+	bool error (!GetProcessAffinityMask (GetCurrentProcess (), &process_mask, &system_mask));
+	if (!error)
+	{
+		cpus_a = 0;
+		for (; process_mask != 0; process_mask &= process_mask - 1)
+		{
+			++cpus_a;
+		}
+		// Job objects may cap the CPU rate as a percentage of the whole machine, in hundredths of a percent
+		JOBOBJECT_CPU_RATE_CONTROL_INFORMATION rate{};
+		if (QueryInformationJobObject (nullptr, JobObjectCpuRateControlInformation, &rate, sizeof (rate), nullptr) && (rate.ControlFlags & JOB_OBJECT_CPU_RATE_CONTROL_ENABLE) && (rate.ControlFlags & JOB_OBJECT_CPU_RATE_CONTROL_HARD_CAP))
+		{
+			auto quota ((static_cast<unsigned long long> (rate.CpuRate) * GetActiveProcessorCount (ALL_PROCESSOR_GROUPS) + 9999) / 10000);
+			cpus_a = std::min (cpus_a, static_cast<unsigned> (std::max (1ULL, quota)));
+		}
+		error = cpus_a == 0;
+	}
+	return error;
+}
+
+bool cpu_throttling_get (nano_pow::cpu_throttling &)
+{
+	// Job objects do not report throttling
+	return true;
+}
+}
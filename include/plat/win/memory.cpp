@@ -44,6 +44,22 @@ bool memory_available (size_t & memory)
 	return error;
 }
 
+bool memory_total (size_t & memory)
+{
+	bool error{ false };
+	MEMORYSTATUSEX statex;
+	statex.dwLength = sizeof (statex);
+	if (GlobalMemoryStatusEx (&statex))
+	{
+		memory = static_cast<size_t> (statex.ullTotalPhys);
+	}
+	else
+	{
+		error = true;
+	}
+	return error;
+}
+
 void memory_init ()
 {
 	HANDLE hToken = nullptr;
@@ -83,11 +99,29 @@ uint32_t * alloc (size_t memory, bool & error)
 	{
 		// There was an issue using the large memory pages locked in physical memory, so try and allocate without.
 		alloc = VirtualAlloc (nullptr, memory, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
-		error |= (alloc == nullptr);
 	}
+	// Checked for both paths, allocations without large pages can fail as well
+	error |= (alloc == nullptr);
 	return reinterpret_cast<uint32_t *> (alloc);
 }
 
+void discard_page_memory (uint32_t * begin, size_t size)
+{
+	// Large pages are locked in memory and cannot be reset
+	if (!use_large_mem_pages)
+	{
+		SYSTEM_INFO info;
+		GetSystemInfo (&info);
+		auto page (static_cast<uintptr_t> (info.dwPageSize));
+		auto first ((reinterpret_cast<uintptr_t> (begin) + page - 1) / page * page);
+		auto last (reinterpret_cast<uintptr_t> (begin + size) / page * page);
+		if (last > first)
+		{
+			VirtualAlloc (reinterpret_cast<void *> (first), last - first, MEM_RESET, PAGE_READWRITE);
+		}
+	}
+}
+
 void free_page_memory (uint32_t * slab, size_t)
 {
 	if (slab)
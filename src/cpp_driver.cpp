@@ -1,14 +1,18 @@
 #include <nano_pow/conversions.hpp>
 #include <nano_pow/cpp_driver.hpp>
+#include <nano_pow/cpu.hpp>
 #include <nano_pow/plat.hpp>
 #include <nano_pow/pow.hpp>
 
+#include <algorithm>
 #include <atomic>
+#include <cmath>
 #include <cstdint>
 #include <cstring>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
+#include <stdexcept>
 #include <thread>
 #include <vector>
 
@@ -180,6 +184,46 @@ uint8_t * out, const size_t outlen)
 	return 0;
 }
 
+/*
+ * First output word of SipHash-2-4 with a 16 byte output, for a single 64 bit message word
+ *
+ * Equal to the low word written by siphash, but stops before the second finalization
+ */
+NP_INLINE static uint64_t siphash_low (uint64_t const item_a, const uint8_t * k)
+{
+	uint64_t v0 = 0x736f6d6570736575ULL;
+	uint64_t v1 = 0x646f72616e646f6dULL;
+	uint64_t v2 = 0x6c7967656e657261ULL;
+	uint64_t v3 = 0x7465646279746573ULL;
+	uint64_t k0 = U8TO64_LE (k);
+	uint64_t k1 = U8TO64_LE (k + 8);
+	uint64_t m = U8TO64_LE (reinterpret_cast<uint8_t const *> (&item_a));
+	uint64_t b = static_cast<uint64_t> (sizeof (item_a)) << 56;
+	int i;
+	v3 ^= k1;
+	v2 ^= k0;
+	v1 ^= k1;
+	v0 ^= k0;
+
+	v1 ^= 0xee;
+
+	v3 ^= m;
+	for (i = 0; i < cROUNDS; ++i)
+		SIPROUND;
+	v0 ^= m;
+
+	v3 ^= b;
+	for (i = 0; i < cROUNDS; ++i)
+		SIPROUND;
+	v0 ^= b;
+
+	v2 ^= 0xee;
+	for (i = 0; i < dROUNDS; ++i)
+		SIPROUND;
+
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
 NP_INLINE static std::array<uint64_t, 2> lhs_nonce (std::array<uint64_t, 2> item_a)
 {
 	uint64_t lhs_or_mask (~static_cast<uint64_t> (std::numeric_limits<int64_t>::max ()));
@@ -204,6 +248,12 @@ NP_INLINE static nano_pow::uint128_t hash (std::array<uint64_t, 2> nonce_a, uint
 	return result;
 }
 
+// Low word of hash, for callers that only need the bucket or the low word of a sum
+NP_INLINE static uint64_t hash_low (std::array<uint64_t, 2> nonce_a, uint64_t const item_a)
+{
+	return siphash_low (item_a, reinterpret_cast<uint8_t const *> (nonce_a.data ()));
+}
+
 // Hash function H0 sets the high order bit
 NP_INLINE static nano_pow::uint128_t H0 (std::array<uint64_t, 2> nonce_a, uint64_t const item_a)
 {
@@ -228,6 +278,44 @@ nano_pow::uint128_t nano_pow::H1 (std::array<uint64_t, 2> nonce_a, uint64_t cons
 	return ::H1 (nonce_a, item_a);
 }
 
+NP_INLINE static uint64_t H0_low (std::array<uint64_t, 2> nonce_a, uint64_t const item_a)
+{
+	return hash_low (lhs_nonce (nonce_a), item_a);
+}
+
+NP_INLINE static uint64_t H1_low (std::array<uint64_t, 2> nonce_a, uint64_t const item_a)
+{
+	return hash_low (rhs_nonce (nonce_a), item_a);
+}
+
+namespace
+{
+// H0 and H1 as `T` words, the 64 bit search kernel skips the high words
+template <typename T>
+NP_INLINE T H0_word (std::array<uint64_t, 2> nonce_a, uint64_t const item_a)
+{
+	return static_cast<T> (::H0 (nonce_a, item_a));
+}
+
+template <>
+NP_INLINE uint64_t H0_word<uint64_t> (std::array<uint64_t, 2> nonce_a, uint64_t const item_a)
+{
+	return ::H0_low (nonce_a, item_a);
+}
+
+template <typename T>
+NP_INLINE T H1_word (std::array<uint64_t, 2> nonce_a, uint64_t const item_a)
+{
+	return static_cast<T> (::H1 (nonce_a, item_a));
+}
+
+template <>
+NP_INLINE uint64_t H1_word<uint64_t> (std::array<uint64_t, 2> nonce_a, uint64_t const item_a)
+{
+	return ::H1_low (nonce_a, item_a);
+}
+}
+
 NP_INLINE static uint64_t reverse_64 (uint64_t const item_a)
 {
 	auto result (item_a);
@@ -263,6 +351,16 @@ nano_pow::uint128_t nano_pow::bit_difficulty_64 (unsigned bits_a)
 	return bit_difficulty (bits_a + 32);
 }
 
+unsigned nano_pow::difficulty_bits (nano_pow::uint128_t difficulty_a)
+{
+	unsigned result{ 0 };
+	while (result < 128 && (static_cast<uint64_t> (difficulty_a >> (127 - result)) & 1) != 0)
+	{
+		++result;
+	}
+	return result;
+}
+
 static nano_pow::uint128_t sum (std::array<uint64_t, 2> nonce_a, std::array<uint64_t, 2> const solution_a)
 {
 	nano_pow::uint128_t result (::H0 (nonce_a, solution_a[0]) + ::H1 (nonce_a, solution_a[1]));
@@ -290,6 +388,13 @@ static bool passes_sum (nano_pow::uint128_t const sum_a, nano_pow::uint128_t dif
 	return passed;
 }
 
+// Low bits of the sum a solution has at 0, one per leading one of the difficulty. A necessary condition only, passes_sum decides
+static nano_pow::uint128_t quick_mask (nano_pow::uint128_t difficulty_a)
+{
+	auto bits (nano_pow::difficulty_bits (difficulty_a));
+	return bits < 128 ? (static_cast<nano_pow::uint128_t> (1) << bits) - 1 : ~static_cast<nano_pow::uint128_t> (0);
+}
+
 bool nano_pow::passes (std::array<uint64_t, 2> nonce_a, std::array<uint64_t, 2> const solution_a, nano_pow::uint128_t difficulty_a)
 {
 	// Solution is limited to 32 + 48 bits
@@ -303,37 +408,64 @@ bool nano_pow::passes_64 (std::array<uint64_t, 2> nonce_a, std::array<uint64_t,
 	return passes (nonce_a, solution_a, nano_pow::difficulty_64_to_128 (difficulty_a));
 }
 
-NP_INLINE static nano_pow::uint128_t difficulty_quick (nano_pow::uint128_t const sum_a, nano_pow::uint128_t const difficulty_inv_a)
+NP_INLINE static uint64_t multiply_high (uint64_t const a, uint64_t const b)
 {
-	assert ((difficulty_inv_a & (difficulty_inv_a + 1)) == 0);
-	return sum_a & difficulty_inv_a;
+#if defined(_MSC_VER) && defined(_M_X64)
+	return __umulh (a, b);
+#else
+	return static_cast<uint64_t> ((static_cast<nano_pow::uint128_t> (a) * b) >> 64);
+#endif
+}
+
+/**
+ * Shift placing the low ceil(log2 (size_a)) bits of an item at the top of a 64 bit word
+ */
+static unsigned bucket_shift (uint64_t const size_a)
+{
+	// A single bucket still shifts by 63, shifting by 64 is undefined
+	unsigned result (63);
+	for (auto bits ((size_a - 1) >> 1); bits != 0; bits >>= 1)
+	{
+		--result;
+	}
+	return result;
 }
+
 /**
  * Maps item_a to an index within the memory region.
  *
  * @param item_a value that needs to be pigeonholed into an index/bucket.
- *        Naively is (item_a % size_a), but using bitmasking for efficiency.
+ *        Naively is (item_a % size_a), but using a multiply-high range reduction for efficiency.
+ *        Only the low bits selected by shift_a are used, so items whose low bits match share a bucket
+ *        as the search requires. For a power of 2 size this is the same as masking with size_a - 1
  */
-NP_INLINE static uint64_t bucket (uint64_t const size_a, uint64_t const item_a)
+NP_INLINE static uint64_t bucket (uint64_t const size_a, unsigned const shift_a, uint64_t const item_a)
 {
-	auto mask (size_a - 1);
-	assert (((size_a & mask) == 0) && "Slab size is not a power of 2");
-	return item_a & mask;
+	return multiply_high (item_a << shift_a, size_a);
 }
 
-NP_INLINE static bool passes_quick (nano_pow::uint128_t const sum_a, nano_pow::uint128_t const difficulty_inv_a)
+/*
+ * Full 128 bit sum of a candidate found by a search kernel working on `T` words
+ *
+ * The 128 bit kernel already has it, the 64 bit kernel only hashed the low words and computes the high words now
+ */
+NP_INLINE static nano_pow::uint128_t sum_full (nano_pow::uint128_t const sum_a, std::array<uint64_t, 2> const & /* nonce_a */, uint64_t /* lhs_a */, uint64_t /* rhs_a */)
 {
-	assert ((difficulty_inv_a & (difficulty_inv_a + 1)) == 0);
-	auto passed (difficulty_quick (sum_a, difficulty_inv_a) == 0);
-	return passed;
+	return sum_a;
+}
+
+NP_INLINE static nano_pow::uint128_t sum_full (uint64_t const /* sum_a */, std::array<uint64_t, 2> const & nonce_a, uint64_t lhs_a, uint64_t rhs_a)
+{
+	return ::H0 (nonce_a, lhs_a) + ::H1 (nonce_a, rhs_a);
 }
 
 nano_pow::cpp_driver::cpp_driver () :
 difficulty_m (nano_pow::bit_difficulty (8)),
-difficulty_inv (::reverse (difficulty_m))
+difficulty_inv (::quick_mask (difficulty_m))
 {
 	nano_pow::memory_init ();
-	threads_set (std::thread::hardware_concurrency ());
+	// Containers often allow fewer processors than the host has, threads beyond those are throttled
+	threads_set (nano_pow::default_threads ());
 }
 
 nano_pow::cpp_driver::~cpp_driver ()
@@ -344,57 +476,322 @@ nano_pow::cpp_driver::~cpp_driver ()
 
 std::array<uint64_t, 2> nano_pow::cpp_driver::solve (std::array<uint64_t, 2> nonce)
 {
-	result_0 = 0;
-	result_1 = 0;
-	current = 0;
+	solve_begin ();
+	return solve_fresh (nonce);
+}
+
+std::array<uint64_t, 2> nano_pow::cpp_driver::solve_fresh (std::array<uint64_t, 2> nonce)
+{
 	this->nonce[0] = nonce[0];
 	this->nonce[1] = nonce[1];
-	return nano_pow::driver::solve (nonce);
+	if (memory_auto && memory_auto_apply (memory_auto_size (difficulty_m)))
+	{
+		throw std::runtime_error ("Unable to allocate the lookup table");
+	}
+	++table_generation;
+	partition_single (nonce, 0);
+	return solve_single ();
+}
+
+std::array<uint64_t, 2> nano_pow::cpp_driver::solve_single ()
+{
+	if (overlap <= 0)
+	{
+		return solve_loop ();
+	}
+	// The search fills the table in turns until it is complete
+	return search ();
+}
+
+void nano_pow::cpp_driver::partition_single (std::array<uint64_t, 2> nonce, uint64_t const filled)
+{
+	// Reused across solves so the single nonce path does not allocate
+	if (partitions.size () != 1)
+	{
+		partitions = std::vector<partition> (1);
+	}
+	auto & partition_l (partitions.front ());
+	partition_l.result.value[0] = 0;
+	partition_l.result.value[1] = 0;
+	partition_l.nonce = nonce;
+	partition_l.slab = slab.get ();
+	partition_l.size = size;
+	partition_l.current.value = filled;
+}
+
+nano_pow::solve_progress nano_pow::cpp_driver::progress_get () const
+{
+	nano_pow::solve_progress result;
+	if (partitions.size () == 1)
+	{
+		auto const & partition_l (partitions.front ());
+		// Chunks claimed by cancelled threads may be partly filled, the search treats their buckets as junk
+		result.filled = std::min (partition_l.current.value.load (), fill_count (partition_l.size));
+		result.entries = partition_l.size;
+		result.nonce = partition_l.nonce;
+		result.table = table_generation;
+	}
+	return result;
+}
+
+std::array<uint64_t, 2> nano_pow::cpp_driver::resume (std::array<uint64_t, 2> nonce, nano_pow::solve_progress const & progress)
+{
+	// The table must still hold this fill, and be used at the size it was filled for since buckets depend on it
+	solve_begin ();
+	auto resumable (slab && progress.entries != 0 && progress.nonce == nonce && progress.table == table_generation && (memory_auto ? progress.entries <= allocated : progress.entries == size));
+	if (!resumable)
+	{
+		return solve_fresh (nonce);
+	}
+	this->nonce[0] = nonce[0];
+	this->nonce[1] = nonce[1];
+	size = progress.entries;
+	partition_single (nonce, progress.filled);
+	return solve_single ();
+}
+
+std::vector<std::array<uint64_t, 2>> nano_pow::cpp_driver::solve_batch (std::vector<std::array<uint64_t, 2>> const & nonces_a, size_t partitions_a)
+{
+	solve_begin ();
+	std::vector<std::array<uint64_t, 2>> result (nonces_a.size (), { { 0, 0 } });
+	auto count (threads_get ());
+	count = std::min (count, nonces_a.size ());
+	if (partitions_a != 0)
+	{
+		count = std::min (count, partitions_a);
+	}
+	if (count == 0)
+	{
+		return result;
+	}
+	auto minimum (nano_pow::lookup_to_entries (min_auto_lookup));
+	size_t partition_size{ 0 };
+	if (memory_auto)
+	{
+		// Room for `count` tables of the size a single solve would use
+		partition_size = nano_pow::memory_to_entries (memory_auto_size (difficulty_m));
+		auto entries_l (std::min (partition_size * count, std::max (partition_size, nano_pow::lookup_to_entries (max_auto_lookup))));
+		size_t memory_l (nano_pow::entries_to_memory (entries_l));
+		if (memory_auto_apply (memory_l))
+		{
+			throw std::runtime_error ("Unable to allocate the lookup table");
+		}
+	}
+	else if (!slab)
+	{
+		return result;
+	}
+	else
+	{
+		partition_size = std::max (minimum, size / count);
+	}
+	// Partitions are equal regions of the table in use
+	partition_size = std::min (partition_size, size);
+	count = std::min (count, size / partition_size);
+	// Progress taken before the batch does not describe the table anymore
+	++table_generation;
+	for (size_t first (0), n (nonces_a.size ()); !cancel.value && first < n; first += count)
+	{
+		partitions = std::vector<partition> (std::min (count, n - first));
+		for (size_t i (0); i < partitions.size (); ++i)
+		{
+			auto & partition_l (partitions[i]);
+			partition_l.nonce = nonces_a[first + i];
+			partition_l.slab = slab.get () + i * partition_size;
+			partition_l.size = partition_size;
+		}
+		this->nonce = partitions.front ().nonce;
+		fill ();
+		if (!cancel.value)
+		{
+			search ();
+		}
+		for (size_t i (0); !cancel.value && i < partitions.size (); ++i)
+		{
+			result[first + i] = { partitions[i].result.value[0].load (), partitions[i].result.value[1].load () };
+		}
+	}
+	return result;
+}
+
+bool nano_pow::cpp_driver::memory_auto_apply (size_t memory_a)
+{
+	auto memory_l (memory_a);
+	auto minimum (nano_pow::entries_to_memory (nano_pow::lookup_to_entries (min_auto_lookup)));
+	// Fall back to smaller tables if the allocation fails
+	while (memory_l != memory_get () && memory_allocate (memory_l) && memory_l > minimum)
+	{
+		memory_l /= 2;
+	}
+	return memory_l != memory_get ();
+}
+
+void nano_pow::cpp_driver::memory_auto_set (bool memory_auto_a)
+{
+	memory_auto = memory_auto_a;
+}
+
+bool nano_pow::cpp_driver::memory_auto_get () const
+{
+	return memory_auto;
+}
+
+size_t nano_pow::cpp_driver::memory_auto_size (nano_pow::uint128_t difficulty_a) const
+{
+	// A table of M entries costs M * fill_cost to fill and about 2^bits / M attempts to search
+	// The total is lowest at M = sqrt (2^bits * search_cost / fill_cost)
+	// Until measured, a ratio of 4 matches the lookup of bits / 2 + 1 used by the command line
+	auto ratio (fill_cost > 0 && search_cost > 0 ? search_cost / fill_cost : 4.0);
+	auto lookup (std::lround ((nano_pow::difficulty_bits (difficulty_a) + std::log2 (ratio)) / 2));
+	lookup = std::max (lookup, static_cast<long> (min_auto_lookup));
+	lookup = std::min (lookup, static_cast<long> (max_auto_lookup));
+	auto result (nano_pow::entries_to_memory (nano_pow::lookup_to_entries (static_cast<size_t> (lookup))));
+	auto minimum (nano_pow::entries_to_memory (nano_pow::lookup_to_entries (min_auto_lookup)));
+	size_t max_memory{ 0 };
+	if (!memory_max (max_memory))
+	{
+		result = std::max (minimum, std::min (result, max_memory));
+	}
+	return result;
+}
+
+bool nano_pow::cpp_driver::memory_max (size_t & memory_a) const
+{
+	size_t available{ 0 };
+	auto error (nano_pow::memory_available (available));
+	if (!error)
+	{
+		// The current table is released before a new one is allocated, and 1/16 is left for everything else
+		available += memory_allocated_get ();
+		available -= available / 16;
+		// Tables need not be a power of 2, whole megabytes are used so the size stays a multiple of the page size
+		size_t constexpr granularity{ 1 << 20 };
+		auto result (nano_pow::entries_to_memory (nano_pow::lookup_to_entries (max_lookup)));
+		memory_a = std::min (result, available / granularity * granularity);
+	}
+	return error;
+}
+
+size_t nano_pow::cpp_driver::memory_allocated_get () const
+{
+	return slab ? nano_pow::entries_to_memory (allocated) : 0;
 }
 
 bool nano_pow::cpp_driver::memory_set (size_t memory)
 {
-	size = nano_pow::memory_to_entries (memory);
+	memory_auto = false;
+	return memory_allocate (memory);
+}
+
+bool nano_pow::cpp_driver::memory_allocate (size_t memory)
+{
 	assert (memory > 0);
-	assert ((memory & (memory - 1)) == 0);
-	assert (size <= nano_pow::lookup_to_entries (32)); // 16GB limit
+	assert (memory % sizeof (uint32_t) == 0);
+	assert (nano_pow::memory_to_entries (memory) <= nano_pow::lookup_to_entries (max_lookup)); // 256GB limit
 	bool error = false;
-	size_t available = std::numeric_limits<uint32_t>::max ();
-	// Memory availability checking
-	// Only Windows is supported
-	if (!nano_pow::memory_available (available) && available < memory)
+	if (slab && nano_pow::memory_to_entries (memory) <= allocated)
 	{
-		memory_reset ();
-		if (!nano_pow::memory_available (available) && available < memory)
+		// Served from the arena, a prefix of the mapping is used without remapping it
+		size = nano_pow::memory_to_entries (memory);
+		size_t available{ 0 };
+		// Unused resident pages are given back once keeping them would take more than the memory left
+		if (resident > size && !nano_pow::memory_available (available) && available < nano_pow::entries_to_memory (resident - size))
 		{
-			error = true;
-			std::cerr << "Insufficient memory available" << std::endl;
+			memory_trim ();
 		}
+		if (prefault_enabled && resident < size)
+		{
+			prefault (slab.get () + resident, size - resident);
+		}
+		// Without prefaulting the pages are faulted in by the fill
+		resident = std::max (resident, size);
+		if (verbose)
+		{
+			std::cout << "Memory set to " << nano_pow::to_megabytes (memory) << "MB of " << nano_pow::to_megabytes (memory_allocated_get ()) << "MB allocated" << std::endl;
+		}
+		return error;
+	}
+	// The previous table is released first so both are never mapped at once
+	memory_reset ();
+	size = nano_pow::memory_to_entries (memory);
+	size_t available = std::numeric_limits<uint32_t>::max ();
+	// Refused up front rather than risking swapping or the process being killed while filling
+	if (!nano_pow::memory_available (available) && available < memory)
+	{
+		error = true;
+		std::cerr << "Insufficient memory available, " << nano_pow::to_megabytes (available) << "MB" << std::endl;
 	}
 	if (!error)
 	{
-		slab = std::unique_ptr<uint32_t, std::function<void(uint32_t *)>> (nano_pow::alloc (memory, error), [size = this->size](uint32_t * slab) { free_page_memory (slab, size); });
+		auto slab_l (nano_pow::alloc (memory, error));
 		if (error)
 		{
 			std::cerr << "Error while creating memory buffer" << std::endl;
 		}
-		else if (verbose)
+		else
 		{
-			std::cout << "Memory set to " << nano_pow::to_megabytes (memory) << "MB" << std::endl;
+			slab = std::unique_ptr<uint32_t, std::function<void(uint32_t *)>> (slab_l, [size = this->size](uint32_t * slab) { free_page_memory (slab, size); });
+			allocated = size;
+			if (verbose)
+			{
+				std::cout << "Memory set to " << nano_pow::to_megabytes (memory) << "MB" << std::endl;
+			}
+			if (prefault_enabled)
+			{
+				prefault (slab_l, size);
+			}
+			resident = size;
 		}
 	}
 
 	return error;
 }
 
+void nano_pow::cpp_driver::memory_trim ()
+{
+	if (slab && resident > size)
+	{
+		// Tables filled past the size in use lose their entries
+		++table_generation;
+		nano_pow::discard_page_memory (slab.get () + size, resident - size);
+		if (verbose)
+		{
+			std::cout << "Released " << nano_pow::to_megabytes (nano_pow::entries_to_memory (resident - size)) << "MB" << std::endl;
+		}
+	}
+	resident = std::min (resident, size);
+}
+
+size_t nano_pow::cpp_driver::memory_get () const
+{
+	return slab ? nano_pow::entries_to_memory (size) : 0;
+}
+
 void nano_pow::cpp_driver::memory_reset ()
 {
 	slab.reset ();
+	resident = 0;
+	++table_generation;
+}
+
+nano_pow::profile_key nano_pow::cpp_driver::profile_key_get () const
+{
+	nano_pow::profile_key result;
+	result.driver = "cpp";
+	result.device = nano_pow::cpu_model ();
+	result.cores = std::thread::hardware_concurrency ();
+	size_t memory{ 0 };
+	if (!nano_pow::memory_total (memory))
+	{
+		result.memory = nano_pow::to_megabytes (memory);
+	}
+	return result;
 }
 
 void nano_pow::cpp_driver::threads_set (unsigned threads)
 {
 	this->threads.resize (threads);
+	thread_states = std::vector<nano_pow::padded<thread_state>> (threads);
 }
 
 size_t nano_pow::cpp_driver::threads_get () const
@@ -402,10 +799,146 @@ size_t nano_pow::cpp_driver::threads_get () const
 	return threads.size ();
 }
 
+void nano_pow::cpp_driver::stepping_set (uint32_t stepping_a)
+{
+	assert (stepping_a > 0);
+	stepping = stepping_a;
+}
+
+uint32_t nano_pow::cpp_driver::stepping_get () const
+{
+	return stepping;
+}
+
+void nano_pow::cpp_driver::prefetch_set (unsigned prefetch_a)
+{
+	prefetch = std::max (1U, std::min (prefetch_a, static_cast<unsigned> (max_prefetch)));
+}
+
+unsigned nano_pow::cpp_driver::prefetch_get () const
+{
+	return prefetch;
+}
+
+void nano_pow::cpp_driver::overlap_set (double fraction_a)
+{
+	overlap = std::max (0.0, std::min (fraction_a, 1.0));
+}
+
+double nano_pow::cpp_driver::overlap_get () const
+{
+	return overlap;
+}
+
+void nano_pow::cpp_driver::fill_threads_set (unsigned threads_a)
+{
+	fill_threads = threads_a;
+}
+
+unsigned nano_pow::cpp_driver::fill_threads_get () const
+{
+	return fill_threads;
+}
+
+void nano_pow::cpp_driver::search_threads_set (unsigned threads_a)
+{
+	search_threads = threads_a;
+}
+
+unsigned nano_pow::cpp_driver::search_threads_get () const
+{
+	return search_threads;
+}
+
+void nano_pow::cpp_driver::fill_affinity_set (std::vector<unsigned> const & cpus_a)
+{
+	fill_affinity = cpus_a;
+}
+
+std::vector<unsigned> const & nano_pow::cpp_driver::fill_affinity_get () const
+{
+	return fill_affinity;
+}
+
+void nano_pow::cpp_driver::search_affinity_set (std::vector<unsigned> const & cpus_a)
+{
+	search_affinity = cpus_a;
+}
+
+std::vector<unsigned> const & nano_pow::cpp_driver::search_affinity_get () const
+{
+	return search_affinity;
+}
+
+size_t nano_pow::cpp_driver::phase_threads (unsigned threads_a) const
+{
+	auto pool (threads.size ());
+	return threads_a == 0 ? pool : std::min<size_t> (threads_a, pool);
+}
+
+void nano_pow::cpp_driver::phase_affinity (std::vector<unsigned> const & cpus_a, size_t thread_id) const
+{
+	// Threads are left alone unless some phase pins them, otherwise they are unpinned for unpinned phases
+	if (!fill_affinity.empty () || !search_affinity.empty ())
+	{
+		auto error (cpus_a.empty () ? nano_pow::thread_affinity_set ({}) : nano_pow::thread_affinity_set ({ cpus_a[thread_id % cpus_a.size ()] }));
+		if (error && verbose && thread_id == 0)
+		{
+			std::cerr << "Unable to set thread affinity" << std::endl;
+		}
+	}
+}
+
+void nano_pow::cpp_driver::prefault_set (bool prefault_a)
+{
+	prefault_enabled = prefault_a;
+}
+
+bool nano_pow::cpp_driver::prefault_get () const
+{
+	return prefault_enabled;
+}
+
+std::chrono::nanoseconds nano_pow::cpp_driver::prefault_duration_get () const
+{
+	return prefault_duration;
+}
+
+void nano_pow::cpp_driver::prefault (uint32_t * slab_a, size_t entries_a)
+{
+	auto start (std::chrono::steady_clock::now ());
+	// One store per 4KB page, larger pages are touched several times
+	size_t constexpr page_entries{ 4096 / sizeof (uint32_t) };
+	auto operation = [slab_a, entries_a](size_t thread_id, size_t total_threads) {
+		// Each thread faults its own range, so pages are also placed near the threads on NUMA systems
+		auto begin (entries_a * thread_id / total_threads);
+		auto end (entries_a * (thread_id + 1) / total_threads);
+		for (auto i ((begin + page_entries - 1) / page_entries * page_entries); i < end; i += page_entries)
+		{
+			slab_a[i] = 0;
+		}
+	};
+	if (threads.size () > 0)
+	{
+		threads.execute (operation);
+		threads.barrier ();
+	}
+	else
+	{
+		operation (0, 1);
+	}
+	prefault_duration = std::chrono::steady_clock::now () - start;
+	if (verbose)
+	{
+		std::cout << "Prefaulted in " << std::chrono::duration_cast<std::chrono::milliseconds> (prefault_duration).count () << " ms" << std::endl;
+	}
+}
+
 void nano_pow::cpp_driver::difficulty_set (nano_pow::uint128_t difficulty_a)
 {
-	difficulty_inv = ::reverse (difficulty_a);
+	difficulty_inv = ::quick_mask (difficulty_a);
 	difficulty_m = difficulty_a;
+	profile_apply ();
 }
 
 nano_pow::uint128_t nano_pow::cpp_driver::difficulty_get () const
@@ -420,56 +953,115 @@ std::string to_string_hex (uint32_t value_a)
 	stream << value_a;
 	return stream.str ();
 }
-void nano_pow::cpp_driver::fill_impl (uint64_t const count, uint64_t const begin)
+void nano_pow::cpp_driver::fill_impl (partition & partition_a, uint64_t const count, uint64_t const begin)
 {
 	//std::cout << (std::string ("Fill ") + to_string_hex (begin) + ' ' + to_string_hex (count) + '\n');
-	auto size_l (size);
-	auto nonce_l (nonce);
-	auto slab_l (slab.get ());
-	for (uint64_t current (begin), end (current + count); !cancel && current < end;)
+	auto size_l (partition_a.size);
+	auto nonce_l (partition_a.nonce);
+	auto slab_l (partition_a.slab);
+	auto shift_l (::bucket_shift (size_l));
+	for (uint64_t current (begin), end (current + count); !cancel.value && current < end;)
 	{
-		for (auto stepping_end (current + stepping); current < stepping_end; ++current)
+		for (auto stepping_end (std::min (current + stepping, end)); current < stepping_end; ++current)
 		{
 			uint32_t current_32 (static_cast<uint32_t> (current));
-			slab_l[bucket (size_l, static_cast<uint64_t> (::H0 (nonce_l, current_32)))] = current_32;
+			slab_l[bucket (size_l, shift_l, ::H0_low (nonce_l, current_32))] = current_32;
 		}
 	}
 }
 
+template <typename T>
 void nano_pow::cpp_driver::search_impl (size_t thread_id)
 {
 	xor_shift::hash prng (thread_id + 1);
 	//std::cout << (std::string ("Search ") + to_string_hex (begin) + ' ' + to_string_hex (count) + '\n');
-	auto size_l (size);
-	auto nonce_l (nonce);
-	auto slab_l (slab.get ());
+	auto stepping_l (stepping);
+	auto prefetch_l (prefetch);
 	size_t constexpr max_48bit{ (1ULL << 48) - 1 };
-	while (!cancel && result_0 == 0)
+	std::array<uint64_t, max_prefetch> rhs_l;
+	std::array<T, max_prefetch> hash_l;
+	// The low order bits of the sum that must be 0 for a solution, checked before the full comparison
+	assert ((difficulty_inv & (difficulty_inv + 1)) == 0);
+	auto difficulty_inv_l (static_cast<T> (difficulty_inv));
+	uint64_t searched_l{ 0 };
+	auto & state_l (thread_states[thread_id].value);
+	// Turns of an overlapped fill are taken by fill threads only, threads of just one phase stick to it
+	auto fills_l (thread_id < phase_threads (fill_threads));
+	auto searches_l (thread_id < phase_threads (search_threads));
+	for (size_t i (0), n (partitions.size ()); !cancel.value && i < n; ++i)
 	{
-		std::array<uint64_t, 2> result_l = { 0, 0 };
-		for (uint32_t j (0), m (stepping); result_l[1] == 0 && j < m; ++j)
+		auto & partition_l (partitions[(thread_id + i) % n]);
+		auto size_l (partition_l.size);
+		auto nonce_l (partition_l.nonce);
+		auto slab_l (partition_l.slab);
+		auto shift_l (::bucket_shift (size_l));
+		auto count_l (fill_count (size_l));
+		auto threshold_l (static_cast<uint64_t> (overlap * count_l));
+		// Search turns owed to this thread, in batches
+		double share_l{ 0 };
+		while (!cancel.value && partition_l.result.value[0] == 0)
 		{
-			uint64_t rhs = prng.next () & max_48bit; // 48 bit solution part
-			auto hash_l (::H1 (nonce_l, rhs));
-			uint64_t lhs = slab_l[bucket (size_l, 0 - static_cast<uint64_t> (hash_l))];
-			auto sum (::H0 (nonce_l, lhs) + hash_l);
-			// Check if the solution passes through the quick path then check it through the long path
-			if (!passes_quick (sum, difficulty_inv))
+			auto filled_l (partition_l.current.value.load (std::memory_order_relaxed));
+			if (filled_l < count_l && fills_l)
+			{
+				// Past the threshold the share of batches spent searching follows the share of the table filled
+				share_l += !searches_l || filled_l < threshold_l ? 0 : static_cast<double> (filled_l) / count_l;
+				if (share_l < 1)
+				{
+					auto begin (partition_l.current.value.fetch_add (stepping_l));
+					if (begin < count_l)
+					{
+						fill_impl (partition_l, std::min<uint64_t> (stepping_l, count_l - begin), begin);
+					}
+					continue;
+				}
+				share_l -= 1;
+			}
+			else if (filled_l < threshold_l)
 			{
-				// Likely
+				// Searches wait for the threshold while fill threads work
+				std::this_thread::yield ();
+				continue;
 			}
-			else
+			else if (!searches_l)
 			{
-				if (passes_sum (sum, difficulty_m))
+				break;
+			}
+			std::array<uint64_t, 2> result_l = { 0, 0 };
+			for (uint32_t j (0), m (stepping_l); result_l[1] == 0 && j < m; j += prefetch_l)
+			{
+				searched_l += prefetch_l;
+				// Hash a batch of attempts and prefetch their buckets before reading any of them
+				for (unsigned k (0); k < prefetch_l; ++k)
 				{
-					result_l = { lhs, rhs };
+					rhs_l[k] = prng.next () & max_48bit; // 48 bit solution part
+					hash_l[k] = H1_word<T> (nonce_l, rhs_l[k]);
+					NP_PREFETCH (&slab_l[bucket (size_l, shift_l, 0 - static_cast<uint64_t> (hash_l[k]))]);
+				}
+				for (unsigned k (0); k < prefetch_l; ++k)
+				{
+					uint64_t lhs = slab_l[bucket (size_l, shift_l, 0 - static_cast<uint64_t> (hash_l[k]))];
+					T sum (H0_word<T> (nonce_l, lhs) + hash_l[k]);
+					// Check if the solution passes through the quick path then check it through the long path
+					if ((sum & difficulty_inv_l) != 0)
+					{
+						// Likely
+					}
+					else
+					{
+						if (passes_sum (sum_full (sum, nonce_l, lhs, rhs_l[k]), difficulty_m))
+						{
+							result_l = { lhs, rhs_l[k] };
+						}
+					}
 				}
 			}
-		}
-		if (result_l[1] != 0)
-		{
-			result_0 = result_l[0];
-			result_1 = result_l[1];
+			state_l.searched.store (searched_l, std::memory_order_relaxed);
+			if (result_l[1] != 0)
+			{
+				partition_l.result.value[0] = result_l[0];
+				partition_l.result.value[1] = result_l[1];
+			}
 		}
 	}
 }
@@ -477,27 +1069,115 @@ void nano_pow::cpp_driver::search_impl (size_t thread_id)
 void nano_pow::cpp_driver::fill ()
 {
 	auto start = std::chrono::steady_clock::now ();
-	threads.execute ([this](size_t /* thread_id */, size_t total_threads) {
-		auto count (fill_count ());
-		fill_impl (count / total_threads, current.fetch_add (count / total_threads));
-	});
+	auto fill_threads_l (phase_threads (fill_threads));
+	auto operation = [this, fill_threads_l](size_t thread_id, size_t /* total_threads */) {
+		if (thread_id >= fill_threads_l)
+		{
+			return;
+		}
+		phase_affinity (fill_affinity, thread_id);
+		auto stepping_l (stepping);
+		// Threads start with their own partition then help fill the others
+		for (size_t i (0), n (partitions.size ()); !cancel.value && i < n; ++i)
+		{
+			auto & partition_l (partitions[(thread_id + i) % n]);
+			auto count (fill_count (partition_l.size));
+			// Chunks are claimed as threads go, so `current` tracks fill progress when cancelled
+			for (auto begin (partition_l.current.value.fetch_add (stepping_l)); !cancel.value && begin < count; begin = partition_l.current.value.fetch_add (stepping_l))
+			{
+				fill_impl (partition_l, std::min<uint64_t> (stepping_l, count - begin), begin);
+			}
+		}
+	};
+	threads.execute (operation);
 	threads.barrier ();
+	auto elapsed (std::chrono::steady_clock::now () - start);
+	size_t entries{ 0 };
+	for (auto const & partition_l : partitions)
+	{
+		entries += partition_l.size;
+	}
+	if (!cancel.value && entries > 0)
+	{
+		auto cost (static_cast<double> (std::chrono::duration_cast<std::chrono::nanoseconds> (elapsed).count ()) / entries);
+		fill_cost = fill_cost > 0 ? (fill_cost + cost) / 2 : cost;
+	}
 	if (verbose)
 	{
-		std::cout << "Filled in " << std::chrono::duration_cast<std::chrono::milliseconds> (std::chrono::steady_clock::now () - start).count () << " ms" << std::endl;
+		std::cout << "Filled in " << std::chrono::duration_cast<std::chrono::milliseconds> (elapsed).count () << " ms" << std::endl;
 	}
 }
 
+void nano_pow::cpp_driver::search_kernel_set (nano_pow::search_kernel kernel_a)
+{
+	kernel = kernel_a;
+}
+
+nano_pow::search_kernel nano_pow::cpp_driver::search_kernel_get () const
+{
+	return kernel;
+}
+
+double nano_pow::cpp_driver::search_cost_get () const
+{
+	return search_cost;
+}
+
+uint64_t nano_pow::cpp_driver::searched_get () const
+{
+	uint64_t result{ 0 };
+	for (auto const & state_l : thread_states)
+	{
+		result += state_l.value.searched.load (std::memory_order_relaxed);
+	}
+	return result;
+}
+
 std::array<uint64_t, 2> nano_pow::cpp_driver::search ()
 {
 	auto start = std::chrono::steady_clock::now ();
-	threads.execute ([this](size_t thread_id, size_t /* total_threads */) {
-		search_impl (thread_id);
-	});
+	// Time spent filling is not told apart from time spent searching when they overlap
+	auto overlapped (false);
+	for (auto const & partition_l : partitions)
+	{
+		overlapped = overlapped || partition_l.current.value.load () < fill_count (partition_l.size);
+	}
+	for (auto & state_l : thread_states)
+	{
+		state_l.value.searched = 0;
+	}
+	// The kernel is picked once per search rather than per attempt
+	auto word_64 (kernel == search_kernel::WORD_64 || (kernel == search_kernel::AUTOMATIC && static_cast<uint64_t> (difficulty_inv >> 64) == 0));
+	auto search_threads_l (phase_threads (search_threads));
+	// Fill threads join to take their turns of an overlapped fill
+	auto active_l (overlapped ? std::max (search_threads_l, phase_threads (fill_threads)) : search_threads_l);
+	auto operation = [this, word_64, search_threads_l, active_l](size_t thread_id, size_t /* total_threads */) {
+		if (thread_id >= active_l)
+		{
+			return;
+		}
+		phase_affinity (thread_id < search_threads_l ? search_affinity : fill_affinity, thread_id);
+		if (word_64)
+		{
+			search_impl<uint64_t> (thread_id);
+		}
+		else
+		{
+			search_impl<nano_pow::uint128_t> (thread_id);
+		}
+	};
+	threads.execute (operation);
 	threads.barrier ();
+	auto elapsed (std::chrono::steady_clock::now () - start);
+	auto searched (searched_get ());
+	if (searched > 0 && !overlapped)
+	{
+		auto cost (static_cast<double> (std::chrono::duration_cast<std::chrono::nanoseconds> (elapsed).count ()) / searched);
+		search_cost = search_cost > 0 ? (search_cost + cost) / 2 : cost;
+	}
 	if (verbose)
 	{
-		std::cout << "Searched in " << std::chrono::duration_cast<std::chrono::milliseconds> (std::chrono::steady_clock::now () - start).count () << " ms" << std::endl;
+		std::cout << "Searched in " << std::chrono::duration_cast<std::chrono::milliseconds> (elapsed).count () << " ms" << std::endl;
 	}
 	return result_get ();
 }
@@ -505,63 +1185,74 @@ std::array<uint64_t, 2> nano_pow::cpp_driver::search ()
 void nano_pow::thread_pool::barrier ()
 {
 	std::unique_lock<std::mutex> lock (mutex);
-	finish.wait (lock, [this]() { return ready == threads.size (); });
+	finish.wait (lock, [this]() { return ready == active; });
 }
 
 void nano_pow::thread_pool::resize (size_t threads)
 {
 	barrier ();
+	std::unique_lock<std::mutex> lock (mutex);
+	if (this->threads.size () < threads)
 	{
-		std::unique_lock<std::mutex> lock (mutex);
+		this->threads.reserve (threads);
 		while (this->threads.size () < threads)
 		{
-			this->threads.push_back (std::make_unique<std::thread> ([this, i = this->threads.size ()]() {
+			this->threads.emplace_back ([this, i = this->threads.size ()]() {
 				loop (i);
-			}));
+			});
 		}
-		while (this->threads.size () > threads)
+		active = threads;
+		lock.unlock ();
+		barrier ();
+	}
+	else if (this->threads.size () > threads)
+	{
+		// Every thread is waiting after the barrier, the ones past `threads` exit when woken
+		active = threads;
+		ready = threads;
+		start.notify_all ();
+		lock.unlock ();
+		for (auto i (threads); i < this->threads.size (); ++i)
 		{
-			auto thread (std::move (this->threads.back ()));
-			ready = 0;
-			start.notify_all ();
-			lock.unlock ();
-			thread->join ();
-			lock.lock ();
-			this->threads.pop_back ();
+			this->threads[i].join ();
 		}
+		lock.lock ();
+		this->threads.erase (this->threads.begin () + threads, this->threads.end ());
 	}
-	barrier ();
 }
 
-void nano_pow::thread_pool::execute (std::function<void(size_t, size_t)> operation)
+void nano_pow::thread_pool::execute (nano_pow::function_ref operation)
 {
 	barrier ();
+	std::lock_guard<std::mutex> lock (mutex);
 	this->operation = operation;
 	ready = 0;
+	++generation;
 	start.notify_all ();
 }
 
 void nano_pow::thread_pool::stop ()
 {
-	barrier ();
 	resize (0);
 	assert (ready == 0);
-	assert (!operation);
 }
 
 void nano_pow::thread_pool::loop (size_t thread_id)
 {
 	std::unique_lock<std::mutex> lock (mutex);
-	while (threads[thread_id] != nullptr)
+	auto generation_l (generation);
+	while (thread_id < active)
 	{
 		++ready;
 		finish.notify_all ();
-		start.wait (lock);
-		if (operation && threads[thread_id] != nullptr)
+		start.wait (lock, [this, thread_id, &generation_l]() { return generation != generation_l || thread_id >= active; });
+		if (thread_id < active)
 		{
-			auto threads_size (threads.size ());
+			generation_l = generation;
+			auto operation_l (operation);
+			auto total_threads (active);
 			lock.unlock ();
-			operation (thread_id, threads_size);
+			operation_l (thread_id, total_threads);
 			lock.lock ();
 		}
 	}
@@ -573,20 +1264,36 @@ size_t nano_pow::thread_pool::size () const
 	return threads.size ();
 }
 
-uint64_t nano_pow::cpp_driver::fill_count () const
+uint64_t nano_pow::cpp_driver::fill_count (size_t const size_a) const
 {
-	auto low_fill = std::min (static_cast<size_t> (std::numeric_limits<uint32_t>::max () / 3), size) * 3;
-	auto critical_size (static_cast<nano_pow::uint128_t> (size * size) >= difficulty_inv + 1);
-	return critical_size ? size : low_fill;
+	auto low_fill = std::min (static_cast<size_t> (std::numeric_limits<uint32_t>::max () / 3), size_a) * 3;
+	auto critical_size (static_cast<nano_pow::uint128_t> (size_a) * size_a >= difficulty_inv + 1);
+	// Pre-images are 32 bit, larger tables are filled with all of them
+	return critical_size ? std::min<uint64_t> (size_a, 1ULL << 32) : low_fill;
 }
 
 std::array<uint64_t, 2> nano_pow::cpp_driver::result_get ()
 {
-	std::array<uint64_t, 2> result_l = { result_0.load (), result_1.load () };
+	std::array<uint64_t, 2> result_l = { 0, 0 };
+	if (!partitions.empty ())
+	{
+		result_l = { partitions.front ().result.value[0].load (), partitions.front ().result.value[1].load () };
+	}
 	return result_l;
 }
 
 void nano_pow::cpp_driver::dump () const
 {
 	std::cerr << "Hardware threads: " << std::to_string (std::thread::hardware_concurrency ()) << std::endl;
+	unsigned available{ 0 };
+	if (!nano_pow::cpu_available (available))
+	{
+		std::cerr << "Available processors: " << available << std::endl;
+	}
+	std::cerr << "Threads: " << threads_get () << std::endl;
+	nano_pow::cpu_throttling throttling;
+	if (!nano_pow::cpu_throttling_get (throttling))
+	{
+		std::cerr << "Throttled periods: " << throttling.throttled << " of " << throttling.periods << ", " << std::chrono::duration_cast<std::chrono::milliseconds> (throttling.throttled_time).count () << " ms" << std::endl;
+	}
 }
@@ -1,17 +1,73 @@
+#include <nano_pow/conversions.hpp>
 #include <nano_pow/driver.hpp>
 
-std::array<uint64_t, 2> nano_pow::driver::solve (std::array<uint64_t, 2> nonce)
+#include <iostream>
+
+void nano_pow::driver::solve_begin ()
+{
+	cancel.value = false;
+	auto solve_l (++solves);
+	// Either this sees the token or cancel_solve sees the solve started, so one cancel is enough
+	if (cancelled_solve == solve_l)
+	{
+		cancel.value = true;
+	}
+}
+
+void nano_pow::driver::cancel_solve (uint64_t token_a)
+{
+	cancelled_solve = token_a;
+	if (solves == token_a)
+	{
+		cancel.value = true;
+	}
+}
+
+std::array<uint64_t, 2> nano_pow::driver::solve_loop ()
 {
-	cancel = false;
-	(void)nonce;
 	std::array<uint64_t, 2> result_l = { 0, 0 };
-	while (!cancel && result_l[1] == 0)
+	while (!cancel.value && result_l[1] == 0)
 	{
 		fill ();
-		if (!cancel)
+		if (!cancel.value)
 		{
 			result_l = search ();
 		}
 	}
 	return result_l;
-}
\ No newline at end of file
+}
+bool nano_pow::driver::profile_load (std::string const & path)
+{
+	profile_hardware = profile_key_get ();
+	profile_applied_band = ~0U;
+	return profiles.load (path);
+}
+
+void nano_pow::driver::profile_disable ()
+{
+	profiles.entries.clear ();
+}
+
+void nano_pow::driver::profile_apply ()
+{
+	auto key (profile_hardware);
+	key.band = nano_pow::profile_band (difficulty_get ());
+	if (key.band != profile_applied_band)
+	{
+		profile_applied_band = key.band;
+		if (auto profile_l = profiles.find (key))
+		{
+			if (verbose)
+			{
+				std::cout << "Applying tuning profile: " << profile_l->threads << " threads, stepping " << profile_l->stepping << ", " << nano_pow::to_megabytes (profile_l->memory) << "MB" << std::endl;
+			}
+			threads_set (static_cast<unsigned> (profile_l->threads));
+			stepping_set (profile_l->stepping);
+			// Automatic sizing already picks the memory for each solve
+			if (!memory_auto_get () && memory_get () == 0 && memory_set (profile_l->memory))
+			{
+				std::cerr << "Failed to apply tuning profile memory of " << nano_pow::to_megabytes (profile_l->memory) << "MB" << std::endl;
+			}
+		}
+	}
+}
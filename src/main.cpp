@@ -1,5 +1,6 @@
 #include <nano_pow/conversions.hpp>
 #include <nano_pow/cpp_driver.hpp>
+#include <nano_pow/cpu.hpp>
 #include <nano_pow/opencl_driver.hpp>
 #include <nano_pow/tuning.hpp>
 
@@ -33,6 +34,32 @@ std::string to_string_solution (std::array<uint64_t, 2> nonce_a, std::array<uint
 	oss << "H0(" << to_string_hex64 (lhs) << ")+H1(" << to_string_hex64 (rhs) << ")=" << to_string_hex128 (sum) << " " << to_string_hex128 (difficulty);
 	return oss.str ();
 }
+// Parses processor lists such as "0,2,4-7", returns true on error
+bool parse_cpus (std::string const & text_a, std::vector<unsigned> & cpus_a)
+{
+	bool error (text_a.empty ());
+	std::istringstream stream (text_a);
+	std::string item;
+	while (!error && std::getline (stream, item, ','))
+	{
+		unsigned first{ 0 };
+		unsigned last{ 0 };
+		char dash{ 0 };
+		std::istringstream range (item);
+		range >> first;
+		last = first;
+		if (!range.fail () && !range.eof () && range.peek () == '-')
+		{
+			range >> dash >> last;
+		}
+		error = range.fail () || !range.eof () || last < first;
+		for (auto cpu (first); !error && cpu <= last; ++cpu)
+		{
+			cpus_a.push_back (cpu);
+		}
+	}
+	return error;
+}
 uint64_t profile (nano_pow::driver & driver_a, unsigned threads, nano_pow::uint128_t difficulty, uint64_t memory, unsigned count)
 {
 	std::cout << "Initializing driver" << std::endl;
@@ -41,11 +68,20 @@ uint64_t profile (nano_pow::driver & driver_a, unsigned threads, nano_pow::uint1
 		driver_a.threads_set (threads);
 	}
 	driver_a.difficulty_set (difficulty);
-	if (driver_a.memory_set (memory))
+	// No memory leaves the cpp driver sizing its table for each solve
+	if (memory != 0 && driver_a.memory_get () != memory && driver_a.memory_set (memory))
 	{
 		std::cerr << "Failed to allocate " << nano_pow::to_megabytes (memory) << "MB" << std::endl;
 		exit (1);
 	}
+	if (memory != 0 && driver_a.type () == nano_pow::driver_type::CPP)
+	{
+		auto & cpp_driver (reinterpret_cast<nano_pow::cpp_driver &> (driver_a));
+		if (cpp_driver.prefault_get ())
+		{
+			std::cout << "Prefault ms: " << std::chrono::duration_cast<std::chrono::milliseconds> (cpp_driver.prefault_duration_get ()).count () << std::endl;
+		}
+	}
 	std::cout << "Starting profile" << std::endl;
 	uint64_t total_time (0);
 	try
@@ -86,15 +122,102 @@ uint64_t profile_validate (uint64_t count)
 	std::cout << "Average validation time: " << std::to_string (average) << " ns (" << std::to_string (static_cast<unsigned> (count * 1e9 / total_time)) << " validations/s)" << std::endl;
 	return average;
 }
-void tune (nano_pow::driver * driver_a, nano_pow::uint128_t difficulty, unsigned const count, size_t const initial_threads, size_t const initial_memory)
+// Solves `count` problems with 1, 2, 4... up to `max_threads` threads and reports how the solution rate scales
+void scaling (nano_pow::cpp_driver & driver_a, nano_pow::uint128_t difficulty, uint64_t memory, unsigned max_threads, unsigned count)
+{
+	driver_a.difficulty_set (difficulty);
+	if (driver_a.memory_set (memory))
+	{
+		std::cerr << "Failed to allocate " << nano_pow::to_megabytes (memory) << "MB" << std::endl;
+		return;
+	}
+	std::cout << "Threads\tms/solution\tMattempts/s\tSpeedup\tEfficiency" << std::endl;
+	double base_time{ 0 };
+	for (unsigned threads (1); threads <= max_threads; threads = threads < max_threads ? std::min (threads * 2, max_threads) : threads + 1)
+	{
+		driver_a.threads_set (threads);
+		uint64_t searched{ 0 };
+		auto start (std::chrono::steady_clock::now ());
+		for (auto i (0UL); i < count; ++i)
+		{
+			std::array<uint64_t, 2> nonce{ i + 1, threads };
+			driver_a.solve (nonce);
+			searched += driver_a.searched_get ();
+		}
+		auto total_time (static_cast<double> (std::chrono::duration_cast<std::chrono::microseconds> (std::chrono::steady_clock::now () - start).count ()));
+		auto time (total_time / count / 1000);
+		base_time = threads == 1 ? time : base_time;
+		auto speedup (base_time / time);
+		std::cout << threads << "\t" << time << "\t" << searched / total_time << "\t" << speedup << "\t" << speedup / threads << std::endl;
+	}
+}
+// Solves `count` problems with each search kernel on the same table and reports their search cost
+void profile_kernels (nano_pow::cpp_driver & driver_a, nano_pow::uint128_t difficulty, uint64_t memory, unsigned count)
+{
+	driver_a.difficulty_set (difficulty);
+	if (driver_a.memory_set (memory))
+	{
+		std::cerr << "Failed to allocate " << nano_pow::to_megabytes (memory) << "MB" << std::endl;
+		return;
+	}
+	std::cout << "Kernel\tms/solution\tns/attempt" << std::endl;
+	for (auto kernel : { nano_pow::search_kernel::WORD_128, nano_pow::search_kernel::WORD_64 })
+	{
+		driver_a.search_kernel_set (kernel);
+		uint64_t total_time{ 0 };
+		double search_cost{ 0 };
+		for (auto i (0UL); i < count; ++i)
+		{
+			std::array<uint64_t, 2> nonce{ i + 1, 0 };
+			auto start (std::chrono::steady_clock::now ());
+			driver_a.solve (nonce);
+			total_time += std::chrono::duration_cast<std::chrono::microseconds> (std::chrono::steady_clock::now () - start).count ();
+			search_cost += driver_a.search_cost_get ();
+		}
+		std::cout << (kernel == nano_pow::search_kernel::WORD_64 ? "64 bit" : "128 bit") << "\t" << total_time / 1000. / count << "\t" << search_cost / count << std::endl;
+	}
+	driver_a.search_kernel_set (nano_pow::search_kernel::AUTOMATIC);
+}
+void profile_write (nano_pow::driver * driver_a, nano_pow::uint128_t difficulty, size_t const memory, size_t const threads, std::string const & path)
+{
+	nano_pow::profiles profiles;
+	// A missing file or one from another version is replaced
+	profiles.load (path);
+	nano_pow::profile profile_l;
+	profile_l.key = driver_a->profile_key_get ();
+	profile_l.key.band = nano_pow::profile_band (difficulty);
+	profile_l.memory = memory;
+	profile_l.threads = threads;
+	profile_l.stepping = driver_a->stepping_get ();
+	profiles.put (profile_l);
+	if (profiles.save (path))
+	{
+		std::cerr << "Failed to write tuning profile to " << path << std::endl;
+	}
+	else
+	{
+		std::cerr << "Tuning profile written to " << path << std::endl;
+	}
+}
+// Writes the best configuration to `profile_path` unless it is empty
+void tune (nano_pow::driver * driver_a, nano_pow::uint128_t difficulty, unsigned const count, size_t const initial_threads, size_t const initial_memory, bool const joint, std::string const & profile_path)
 {
 	driver_a->difficulty_set (difficulty);
 	if (driver_a->type () == nano_pow::driver_type::CPP)
 	{
-		size_t best_memory{ 0 };
-		if (!nano_pow::tune (*reinterpret_cast<nano_pow::cpp_driver *> (driver_a), count, initial_memory, initial_threads, best_memory, std::cerr))
+		std::vector<nano_pow::tune_result> ranked;
+		auto space (nano_pow::tune_space_default (initial_memory, initial_threads));
+		space.joint = joint;
+		if (!nano_pow::tune (*reinterpret_cast<nano_pow::cpp_driver *> (driver_a), count, space, ranked, std::cerr))
 		{
-			std::cerr << "Tuning results:\nRecommended memory\t" << nano_pow::to_megabytes (best_memory) << "MB" << std::endl;
+			auto const & best (ranked.front ());
+			std::cerr << "Tuning results:\n";
+			nano_pow::tune_report (ranked, std::cerr);
+			std::cerr << "Recommended memory\t" << nano_pow::to_megabytes (best.memory) << "MB\nRecommended threads\t" << best.threads << "\nRecommended fill threads\t" << (best.fill_threads == 0 ? best.threads : best.fill_threads) << "\nRecommended stepping\t" << best.stepping << "\nRecommended prefetch\t" << best.prefetch << std::endl;
+			if (!profile_path.empty ())
+			{
+				profile_write (driver_a, difficulty, best.memory, best.threads, profile_path);
+			}
 		}
 	}
 	else if (driver_a->type () == nano_pow::driver_type::OPENCL)
@@ -102,7 +225,12 @@ void tune (nano_pow::driver * driver_a, nano_pow::uint128_t difficulty, unsigned
 		size_t max_memory{ 0 }, best_memory{ 0 }, best_threads{ 0 };
 		if (!nano_pow::tune (*reinterpret_cast<nano_pow::opencl_driver *> (driver_a), count, initial_memory, initial_threads, max_memory, best_memory, best_threads, std::cerr))
 		{
-			std::cerr << "Tuning results:\nMaximum memory\t\t" << nano_pow::to_megabytes (max_memory) << "MB\nRecommended memory\t" << nano_pow::to_megabytes (best_memory) << "MB\nRecommended threads\t" << best_threads << std::endl;
+			auto staged (reinterpret_cast<nano_pow::opencl_driver *> (driver_a)->fill_staged_get ());
+			std::cerr << "Tuning results:\nMaximum memory\t\t" << nano_pow::to_megabytes (max_memory) << "MB\nRecommended memory\t" << nano_pow::to_megabytes (best_memory) << "MB\nRecommended threads\t" << best_threads << "\nRecommended fill\t" << (staged ? "staged" : "direct") << std::endl;
+			if (!profile_path.empty ())
+			{
+				profile_write (driver_a, difficulty, best_memory, best_threads, profile_path);
+			}
 		}
 	}
 	else
@@ -118,13 +246,26 @@ int main (int argc, char ** argv)
 	options.add_options ()
 	// clang-format off
 		("driver", "Specify which test driver to use", cxxopts::value<std::string>()->default_value("cpp"), "cpp|opencl")
-		("operation", "Specify which driver operation to perform", cxxopts::value<std::string>()->default_value("gtest"), "gtest|dump|profile|profile_validation|tune")
+		("operation", "Specify which driver operation to perform", cxxopts::value<std::string>()->default_value("gtest"), "gtest|dump|profile|profile_validation|profile_kernels|tune|scaling")
 		("d,difficulty", "Solution difficulty 1-127 default: 52", cxxopts::value<unsigned>()->default_value("52"))
 		("t,threads", "Number of device threads to use to find solution", cxxopts::value<unsigned>())
-		("l,lookup", "Scale of lookup table (N). Table contains 2^N entries, N defaults to (difficulty/2 + 1)", cxxopts::value<unsigned>())
+		("l,lookup", "Scale of lookup table (N). Table contains 2^N entries, up to 36 for cpp and 32 for opencl. N defaults to (difficulty/2 + 1) for opencl, the cpp driver sizes it for each solution", cxxopts::value<unsigned>())
 		("c,count", "Specify how many problems to solve, default 16", cxxopts::value<unsigned>()->default_value("16"))
+		("stepping", "Number of hashes each thread computes per batch", cxxopts::value<uint32_t>())
+		("prefetch", "Number of search attempts prefetched together by the cpp driver, 1-16", cxxopts::value<unsigned>())
+		("no_prefault", "Leave cpp driver tables to be faulted in by the first fill instead of touching them when allocated")
+		("fill_threads", "Number of threads the cpp driver fills with, at most threads, default: all", cxxopts::value<unsigned>())
+		("search_threads", "Number of threads the cpp driver searches with, at most threads, default: all", cxxopts::value<unsigned>())
+		("fill_affinity", "Processors the cpp driver fill threads are pinned to, one per thread, e.g. 0-7 or 0,2,4,6", cxxopts::value<std::string>())
+		("search_affinity", "Processors the cpp driver search threads are pinned to, one per thread, e.g. 0-15", cxxopts::value<std::string>())
+		("overlap", "Fraction of the cpp driver table filled before searching starts, the rest is filled while searching. 0 fills completely first", cxxopts::value<double>())
 		("platform", "Defines the <platform> for OpenCL driver", cxxopts::value<unsigned short>())
 		("device", "Defines <device> for OpenCL driver", cxxopts::value<unsigned short>())
+		("fill_staged", "Use the local memory staged fill kernel for OpenCL driver")
+		("adaptive", "Adapt OpenCL stepping and threads at runtime to the measured launch duration")
+		("profile", "Tuning profile file read at startup and written by tune, default: NANO_POW_PROFILE or ~/.nano_pow_profiles", cxxopts::value<std::string>())
+		("no_profile", "Neither apply nor write tuning profiles")
+		("tune_joint", "Tune the cpp driver over every combination of threads, fill threads, lookup, stepping and prefetch rather than one at a time, much slower")
 		("v,verbose", "Display more messages")
 		("h,help", "Print this message");
 	// clang-format on
@@ -158,8 +299,16 @@ int main (int argc, char ** argv)
 				{
 					device = parsed["device"].as<unsigned short> ();
 				}
-				bool initialize{ operation != "dump" };
-				driver = std::make_unique<nano_pow::opencl_driver> (platform, device, initialize);
+				auto opencl_driver (std::make_unique<nano_pow::opencl_driver> (platform, device, false));
+				// Set early so program build and cache timings are reported
+				opencl_driver->verbose_set (parsed.count ("verbose") == 1);
+				if (operation != "dump")
+				{
+					opencl_driver->initialize (platform, device);
+				}
+				opencl_driver->fill_staged_set (parsed.count ("fill_staged") == 1);
+				opencl_driver->adaptive_set (parsed.count ("adaptive") == 1);
+				driver = std::move (opencl_driver);
 			}
 			else
 			{
@@ -180,7 +329,8 @@ int main (int argc, char ** argv)
 				{
 					lookup = parsed["lookup"].as<unsigned> ();
 				}
-				if (lookup < 1 || lookup > 32)
+				// Only the cpp driver indexes tables beyond 2^32 entries
+				if (lookup < 1 || lookup > (driver->type () == nano_pow::driver_type::CPP ? nano_pow::cpp_driver::max_lookup : 32))
 				{
 					std::cerr << "Incorrect lookup" << std::endl;
 					return -1;
@@ -192,6 +342,59 @@ int main (int argc, char ** argv)
 				{
 					threads = parsed["threads"].as<unsigned> ();
 				}
+				std::string profile_path;
+				if (parsed.count ("no_profile"))
+				{
+					driver->profile_disable ();
+				}
+				else if (operation == "profile" || operation == "tune")
+				{
+					profile_path = parsed.count ("profile") ? parsed["profile"].as<std::string> () : nano_pow::profile_default_path ();
+					driver->profile_load (profile_path);
+					// Applies a matching tuning profile, explicit options below take precedence
+					driver->difficulty_set (nano_pow::bit_difficulty (difficulty));
+					if (parsed.count ("lookup") == 0 && driver->memory_get () != 0)
+					{
+						lookup_entries = nano_pow::memory_to_entries (driver->memory_get ());
+					}
+				}
+				if (parsed.count ("stepping"))
+				{
+					driver->stepping_set (parsed["stepping"].as<uint32_t> ());
+				}
+				if (parsed.count ("prefetch") && driver->type () == nano_pow::driver_type::CPP)
+				{
+					reinterpret_cast<nano_pow::cpp_driver *> (driver.get ())->prefetch_set (parsed["prefetch"].as<unsigned> ());
+				}
+				if (parsed.count ("no_prefault") && driver->type () == nano_pow::driver_type::CPP)
+				{
+					reinterpret_cast<nano_pow::cpp_driver *> (driver.get ())->prefault_set (false);
+				}
+				if (driver->type () == nano_pow::driver_type::CPP)
+				{
+					auto cpp (reinterpret_cast<nano_pow::cpp_driver *> (driver.get ()));
+					if (parsed.count ("fill_threads"))
+					{
+						cpp->fill_threads_set (parsed["fill_threads"].as<unsigned> ());
+					}
+					if (parsed.count ("search_threads"))
+					{
+						cpp->search_threads_set (parsed["search_threads"].as<unsigned> ());
+					}
+					std::vector<unsigned> fill_cpus;
+					std::vector<unsigned> search_cpus;
+					if ((parsed.count ("fill_affinity") && parse_cpus (parsed["fill_affinity"].as<std::string> (), fill_cpus)) || (parsed.count ("search_affinity") && parse_cpus (parsed["search_affinity"].as<std::string> (), search_cpus)))
+					{
+						std::cerr << "Incorrect affinity" << std::endl;
+						return -1;
+					}
+					cpp->fill_affinity_set (fill_cpus);
+					cpp->search_affinity_set (search_cpus);
+				}
+				if (parsed.count ("overlap") && driver->type () == nano_pow::driver_type::CPP)
+				{
+					reinterpret_cast<nano_pow::cpp_driver *> (driver.get ())->overlap_set (parsed["overlap"].as<double> ());
+				}
 				if (operation == "gtest")
 				{
 					testing::InitGoogleTest (&argc, argv);
@@ -207,8 +410,13 @@ int main (int argc, char ** argv)
 					auto threads_l (threads != 0 ? threads : driver->threads_get ());
 					auto driver_difficulty (nano_pow::bit_difficulty (difficulty));
 					auto threshold (nano_pow::reverse (driver_difficulty));
-					std::cout << "Profiling threads: " << std::to_string (threads_l) << " lookup: " << std::to_string (nano_pow::to_megabytes (nano_pow::entries_to_memory (lookup_entries))) << "MB threshold: " << to_string_hex128 (threshold) << " difficulty: " << to_string_hex128 (driver_difficulty) << " (" << to_string_hex64 (nano_pow::difficulty_128_to_64 (driver_difficulty)) << ")" << std::endl;
-					profile (*driver, threads, driver_difficulty, nano_pow::entries_to_memory (lookup_entries), count);
+					auto memory (nano_pow::entries_to_memory (lookup_entries));
+					if (parsed.count ("lookup") == 0 && driver->memory_get () == 0 && driver->type () == nano_pow::driver_type::CPP)
+					{
+						memory = 0;
+					}
+					std::cout << "Profiling threads: " << std::to_string (threads_l) << " lookup: " << (memory != 0 ? std::to_string (nano_pow::to_megabytes (memory)) + "MB" : "automatic") << " threshold: " << to_string_hex128 (threshold) << " difficulty: " << to_string_hex128 (driver_difficulty) << " (" << to_string_hex64 (nano_pow::difficulty_128_to_64 (driver_difficulty)) << ")" << std::endl;
+					profile (*driver, threads, driver_difficulty, memory, count);
 				}
 				else if (operation == "profile_validation")
 				{
@@ -227,11 +435,31 @@ int main (int argc, char ** argv)
 					}
 					std::cout << "Tuning for difficulty " << difficulty << " starting with " << threads_l << " threads and " << nano_pow::to_megabytes (nano_pow::entries_to_memory (lookup_entries)) << "MB memory " << std::endl;
 					std::cout << "This may take a while..." << std::endl;
-					tune (driver.get (), nano_pow::reverse (threshold), count, threads_l, nano_pow::entries_to_memory (lookup_entries));
+					tune (driver.get (), nano_pow::reverse (threshold), count, threads_l, nano_pow::entries_to_memory (lookup_entries), parsed.count ("tune_joint") == 1, profile_path);
+				}
+				else if (operation == "profile_kernels")
+				{
+					if (driver->type () != nano_pow::driver_type::CPP)
+					{
+						std::cerr << "Search kernels are only profiled for the cpp driver" << std::endl;
+						return -1;
+					}
+					profile_kernels (*reinterpret_cast<nano_pow::cpp_driver *> (driver.get ()), nano_pow::bit_difficulty (difficulty), nano_pow::entries_to_memory (lookup_entries), count);
+				}
+				else if (operation == "scaling")
+				{
+					if (driver->type () != nano_pow::driver_type::CPP)
+					{
+						std::cerr << "Scaling is only measured for the cpp driver" << std::endl;
+						return -1;
+					}
+					auto max_threads (threads != 0 ? threads : nano_pow::default_threads ());
+					std::cout << "Scaling up to " << max_threads << " threads with " << nano_pow::to_megabytes (nano_pow::entries_to_memory (lookup_entries)) << "MB memory" << std::endl;
+					scaling (*reinterpret_cast<nano_pow::cpp_driver *> (driver.get ()), nano_pow::bit_difficulty (difficulty), nano_pow::entries_to_memory (lookup_entries), max_threads, count);
 				}
 				else
 				{
-					std::cerr << "Invalid operation. Available: {gtest, dump, profile, profile_validation, tune}" << std::endl;
+					std::cerr << "Invalid operation. Available: {gtest, dump, profile, profile_validation, profile_kernels, tune, scaling}" << std::endl;
 					result = -1;
 				}
 			}
@@ -251,5 +479,9 @@ int main (int argc, char ** argv)
 		std::cerr << "OpenCL error" << std::endl;
 		err.print (std::cerr);
 	}
+	catch (std::runtime_error const & err)
+	{
+		std::cerr << err.what () << std::endl;
+	}
 	return result;
 }
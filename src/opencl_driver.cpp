@@ -4,15 +4,238 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
 #include <sstream>
 #include <string>
 
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 namespace nano_pow
 {
 extern std::string opencl_program;
 }
 
+namespace
+{
+char constexpr program_cache_magic[8]{ 'N', 'P', 'O', 'W', 'B', 'I', 'N', '1' };
+
+// 64-bit FNV-1a, used to key cached program binaries
+uint64_t fnv1a (std::string const & data_a)
+{
+	uint64_t result{ 0xcbf29ce484222325ULL };
+	for (auto c : data_a)
+	{
+		result ^= static_cast<uint8_t> (c);
+		result *= 0x100000001b3ULL;
+	}
+	return result;
+}
+
+// Per user directory for cached binaries, created when missing. Empty when caching is disabled or no directory is writable by the user alone
+std::string program_cache_directory ()
+{
+	std::string result;
+	auto directory (std::getenv ("NANO_POW_CACHE_DIR"));
+#ifdef _WIN32
+	auto local_app_data (std::getenv ("LOCALAPPDATA"));
+	if (directory != nullptr)
+	{
+		result = directory;
+	}
+	else if (local_app_data != nullptr && local_app_data[0] != '\0')
+	{
+		result = std::string (local_app_data) + "\\nano_pow";
+	}
+	if (!result.empty ())
+	{
+		(void)_mkdir (result.c_str ());
+	}
+#else
+	auto cache_home (std::getenv ("XDG_CACHE_HOME"));
+	auto home (std::getenv ("HOME"));
+	std::string base;
+	if (directory != nullptr)
+	{
+		result = directory;
+	}
+	else if (cache_home != nullptr && cache_home[0] != '\0')
+	{
+		base = cache_home;
+	}
+	else if (home != nullptr && home[0] != '\0')
+	{
+		base = std::string (home) + "/.cache";
+	}
+	if (!base.empty ())
+	{
+		(void)mkdir (base.c_str (), 0700);
+		result = base + "/nano_pow";
+	}
+	if (!result.empty ())
+	{
+		(void)mkdir (result.c_str (), 0700);
+		// Binaries are loaded onto the device, others must not be able to plant or replace them
+		struct stat status;
+		if (stat (result.c_str (), &status) != 0 || !S_ISDIR (status.st_mode) || status.st_uid != geteuid () || (status.st_mode & (S_IWGRP | S_IWOTH)) != 0)
+		{
+			result.clear ();
+		}
+	}
+#endif
+	return result;
+}
+
+uint64_t program_cache_key (cl::Device const & device_a, std::string const & source_a)
+{
+	cl::Platform platform (device_a.getInfo<CL_DEVICE_PLATFORM> ());
+	std::string key (source_a);
+	key += '\0' + platform.getInfo<CL_PLATFORM_NAME> ();
+	key += '\0' + platform.getInfo<CL_PLATFORM_VERSION> ();
+	key += '\0' + device_a.getInfo<CL_DEVICE_VENDOR> ();
+	key += '\0' + device_a.getInfo<CL_DEVICE_NAME> ();
+	key += '\0' + device_a.getInfo<CL_DEVICE_VERSION> ();
+	key += '\0' + device_a.getInfo<CL_DRIVER_VERSION> ();
+	return fnv1a (key);
+}
+
+// Kernels take one buffer argument per slab, generated for the number of slabs in use
+std::string slab_definitions (unsigned slabs_a)
+{
+	std::ostringstream oss;
+	oss << "#define SLAB_COUNT " << slabs_a << "\n#define SLAB_PARAMS";
+	for (unsigned i{ 0 }; i < slabs_a; ++i)
+	{
+		oss << ", __global uint * slab_" << i;
+	}
+	oss << "\n#define SLAB_INIT(slabs)";
+	for (unsigned i{ 0 }; i < slabs_a; ++i)
+	{
+		oss << " slabs[" << i << "] = slab_" << i << ";";
+	}
+	oss << "\n";
+	return oss.str ();
+}
+
+std::string program_cache_file (uint64_t key_a)
+{
+	std::string result;
+	auto directory (program_cache_directory ());
+	if (!directory.empty ())
+	{
+		std::ostringstream oss;
+		oss << directory << "/nano_pow_" << std::hex << std::setw (16) << std::setfill ('0') << key_a << ".bin";
+		result = oss.str ();
+	}
+	return result;
+}
+
+// Opens an entry only the user can have written, nullptr otherwise
+FILE * program_cache_open (std::string const & file_a)
+{
+#ifdef _WIN32
+	return std::fopen (file_a.c_str (), "rb");
+#else
+	FILE * result (nullptr);
+	auto descriptor (open (file_a.c_str (), O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+	if (descriptor != -1)
+	{
+		struct stat status;
+		if (fstat (descriptor, &status) == 0 && S_ISREG (status.st_mode) && status.st_uid == geteuid () && (status.st_mode & (S_IWGRP | S_IWOTH)) == 0)
+		{
+			result = fdopen (descriptor, "rb");
+		}
+		if (result == nullptr)
+		{
+			close (descriptor);
+		}
+	}
+	return result;
+#endif
+}
+
+// Returns true on error
+bool program_cache_read (std::string const & file_a, uint64_t key_a, std::vector<char> & binary_a)
+{
+	bool error (true);
+	if (auto file = program_cache_open (file_a))
+	{
+		char magic[sizeof (program_cache_magic)];
+		uint64_t key{ 0 };
+		uint64_t size{ 0 };
+		error = std::fread (magic, sizeof (magic), 1, file) != 1 || std::fread (&key, sizeof (key), 1, file) != 1 || std::fread (&size, sizeof (size), 1, file) != 1;
+		error = error || std::memcmp (magic, program_cache_magic, sizeof (magic)) != 0 || key != key_a || size == 0;
+		if (!error)
+		{
+			binary_a.resize (size);
+			error = std::fread (binary_a.data (), 1, size, file) != size;
+		}
+		std::fclose (file);
+	}
+	return error;
+}
+
+// Creates a temporary file next to `file_a` that no other writer uses, returns nullptr on failure
+FILE * program_cache_temporary (std::string const & file_a, std::string & temporary_a)
+{
+#ifdef _WIN32
+	static std::atomic<unsigned> counter{ 0 };
+	temporary_a = file_a + "." + std::to_string (_getpid ()) + "." + std::to_string (counter++) + ".tmp";
+	// "x" fails rather than share a name left by an earlier process
+	return std::fopen (temporary_a.c_str (), "wbx");
+#else
+	FILE * result (nullptr);
+	temporary_a = file_a + ".XXXXXX";
+	auto descriptor (mkstemp (&temporary_a[0]));
+	if (descriptor != -1)
+	{
+		result = fdopen (descriptor, "wb");
+		if (result == nullptr)
+		{
+			close (descriptor);
+			std::remove (temporary_a.c_str ());
+		}
+	}
+	return result;
+#endif
+}
+
+void program_cache_write (std::string const & file_a, uint64_t key_a, char const * binary_a, uint64_t size_a)
+{
+	// Each writer fills its own temporary file, renamed over the entry so readers never see a partial one
+	std::string temporary;
+	if (auto file = program_cache_temporary (file_a, temporary))
+	{
+		auto error (std::fwrite (program_cache_magic, sizeof (program_cache_magic), 1, file) != 1);
+		error = error || std::fwrite (&key_a, sizeof (key_a), 1, file) != 1 || std::fwrite (&size_a, sizeof (size_a), 1, file) != 1;
+		error = error || std::fwrite (binary_a, 1, size_a, file) != size_a;
+		error = std::fclose (file) != 0 || error;
+#ifdef _WIN32
+		// Renaming does not replace an existing file on Windows
+		if (!error)
+		{
+			std::remove (file_a.c_str ());
+		}
+#endif
+		if (error || std::rename (temporary.c_str (), file_a.c_str ()) != 0)
+		{
+			std::remove (temporary.c_str ());
+		}
+	}
+}
+}
+
 nano_pow::opencl_environment::opencl_environment ()
 {
 	(void)cl::Platform::get (&platforms);
@@ -131,23 +354,49 @@ void nano_pow::opencl_driver::initialize (unsigned short platform_id, unsigned s
 	{
 		throw OCLDriverException (OCLDriverExceptionOrigin::init, err);
 	}
+	try
+	{
+		result_buffer = cl::Buffer (context, CL_MEM_WRITE_ONLY, sizeof (uint64_t) * 2);
+		found_buffer = cl::Buffer (context, CL_MEM_READ_WRITE, sizeof (uint32_t));
+		nonce_buffer = cl::Buffer (context, CL_MEM_READ_WRITE, sizeof (uint64_t) * 2);
+		queue = cl::CommandQueue (context, selected_device);
+		queue.finish ();
+		// Leave room for the other kernel arguments
+		auto parameter_size (selected_device.getInfo<CL_DEVICE_MAX_PARAMETER_SIZE> ());
+		max_slabs = static_cast<unsigned> (parameter_size > 128 + sizeof (cl_mem) ? (parameter_size - 128) / sizeof (cl_mem) : 1);
+	}
+	catch (cl::Error const & err)
+	{
+		throw OCLDriverException (OCLDriverExceptionOrigin::init, err);
+	}
 	// Program
+	kernels_build (1);
+}
+
+void nano_pow::opencl_driver::kernels_build (unsigned slabs_a)
+{
 	try
 	{
-		std::vector<cl::Device> program_devices{ selected_device };
-		program = cl::Program (context, nano_pow::opencl_program, false);
-		program.build (program_devices, nullptr, nullptr);
+		auto start = std::chrono::steady_clock::now ();
+		auto cached (program_build (slabs_a));
+		if (verbose)
+		{
+			std::cout << "Program for " << slabs_a << " slab(s) " << (cached ? "loaded from cache" : "built from source") << " in " << std::chrono::duration_cast<std::chrono::milliseconds> (std::chrono::steady_clock::now () - start).count () << " ms" << std::endl;
+		}
+		program_slabs = slabs_a;
 		fill_impl = cl::Kernel (program, "fill");
+		fill_staged_impl = cl::Kernel (program, "fill_staged");
+		fill_staged_supported = fill_staged_impl.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE> (selected_device) >= fill_stage_size;
 		search_impl = cl::Kernel (program, "search");
-		result_buffer = cl::Buffer (context, CL_MEM_WRITE_ONLY, sizeof (uint64_t) * 2);
-		search_impl.setArg (10, result_buffer);
-		nonce_buffer = cl::Buffer (context, CL_MEM_READ_WRITE, sizeof (uint64_t) * 2);
+		search_impl.setArg (5, result_buffer);
+		search_impl.setArg (6, found_buffer);
+		search_impl.setArg (4, difficulty_inv);
 		search_impl.setArg (1, nonce_buffer);
 		fill_impl.setArg (1, nonce_buffer);
-		search_impl.setArg (2, stepping);
+		fill_staged_impl.setArg (1, nonce_buffer);
+		search_impl.setArg (2, search_stepping);
 		fill_impl.setArg (2, stepping);
-		queue = cl::CommandQueue (context, selected_device);
-		queue.finish ();
+		fill_staged_impl.setArg (2, stepping);
 	}
 	catch (cl::Error const & err)
 	{
@@ -156,11 +405,49 @@ void nano_pow::opencl_driver::initialize (unsigned short platform_id, unsigned s
 	}
 }
 
+bool nano_pow::opencl_driver::program_build (unsigned slabs_a)
+{
+	std::vector<cl::Device> program_devices{ selected_device };
+	auto source (slab_definitions (slabs_a) + nano_pow::opencl_program);
+	auto key (program_cache_key (selected_device, source));
+	auto file (program_cache_file (key));
+	std::vector<char> binary;
+	if (!file.empty () && !program_cache_read (file, key, binary))
+	{
+		try
+		{
+			cl::Program::Binaries binaries{ { binary.data (), binary.size () } };
+			program = cl::Program (context, program_devices, binaries);
+			program.build (program_devices, nullptr, nullptr);
+			return true;
+		}
+		catch (cl::Error const &)
+		{
+			// Stale or corrupt entry, rebuilt from source below
+			std::remove (file.c_str ());
+		}
+	}
+	program = cl::Program (context, source, false);
+	program.build (program_devices, nullptr, nullptr);
+	auto sizes (program.getInfo<CL_PROGRAM_BINARY_SIZES> ());
+	auto binaries (program.getInfo<CL_PROGRAM_BINARIES> ());
+	if (!file.empty () && !sizes.empty () && !binaries.empty () && binaries[0] != nullptr)
+	{
+		program_cache_write (file, key, binaries[0], sizes[0]);
+	}
+	for (auto binary_l : binaries)
+	{
+		delete[] binary_l;
+	}
+	return false;
+}
+
 void nano_pow::opencl_driver::difficulty_set (nano_pow::uint128_t difficulty_a)
 {
 	this->difficulty_inv = nano_pow::reverse (difficulty_a);
 	this->difficulty = difficulty_a;
-	this->search_impl.setArg (9, difficulty_inv);
+	this->search_impl.setArg (4, difficulty_inv);
+	profile_apply ();
 }
 
 nano_pow::uint128_t nano_pow::opencl_driver::difficulty_get () const
@@ -171,6 +458,15 @@ nano_pow::uint128_t nano_pow::opencl_driver::difficulty_get () const
 void nano_pow::opencl_driver::threads_set (unsigned threads)
 {
 	this->threads = threads;
+	search_threads = threads;
+	if (adaptive && search_threads < min_adaptive_threads)
+	{
+		search_threads = min_adaptive_threads;
+	}
+	if (adaptive && search_threads > max_adaptive_threads)
+	{
+		search_threads = max_adaptive_threads;
+	}
 }
 
 size_t nano_pow::opencl_driver::threads_get () const
@@ -178,6 +474,28 @@ size_t nano_pow::opencl_driver::threads_get () const
 	return threads;
 }
 
+void nano_pow::opencl_driver::stepping_set (uint32_t stepping_a)
+{
+	assert (stepping_a > 0);
+	stepping = stepping_a;
+	search_stepping = stepping_a;
+	try
+	{
+		search_impl.setArg (2, stepping);
+		fill_impl.setArg (2, stepping);
+		fill_staged_impl.setArg (2, stepping);
+	}
+	catch (cl::Error const & err)
+	{
+		throw OCLDriverException (OCLDriverExceptionOrigin::setup, err);
+	}
+}
+
+uint32_t nano_pow::opencl_driver::stepping_get () const
+{
+	return stepping;
+}
+
 size_t nano_pow::opencl_driver::max_threads ()
 {
 	auto max_work_sizes = selected_device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES> ();
@@ -189,40 +507,53 @@ size_t nano_pow::opencl_driver::max_threads ()
 	return max_threads;
 }
 
+size_t nano_pow::opencl_driver::max_memory () const
+{
+	// Whole megabytes up to 15/16 of the device memory, the rest is left for the other buffers
+	size_t constexpr granularity{ 1 << 20 };
+	auto result (static_cast<size_t> ((global_mem_size - global_mem_size / 16) / granularity * granularity));
+	return std::min (result, nano_pow::entries_to_memory (nano_pow::lookup_to_entries (32)));
+}
+
 bool nano_pow::opencl_driver::memory_set (size_t memory)
 {
 	assert (memory > 0);
-	assert ((memory & (memory - 1)) == 0);
+	assert (memory % nano_pow::entry_size == 0);
 	assert (memory / nano_pow::entry_size <= nano_pow::lookup_to_entries (32)); // 16GB limit
 
-	// The minimum max alloc size is defined in the OpenCL standard as 1/4 of the global memory size
-	unsigned const number_slabs = memory > max_alloc_size ? 4 : 1;
+	// Use as few slabs as the maximum allocation size allows
+	auto const number_slabs = static_cast<unsigned> (std::max<uint64_t> (1, (memory + max_alloc_size - 1) / max_alloc_size));
+	if (memory > global_mem_size || number_slabs > max_slabs)
+	{
+		std::cerr << "Insufficient device memory for " << nano_pow::to_megabytes (memory) << "MB" << std::endl;
+		return true;
+	}
 
-	slab_size = memory / number_slabs;
 	slab_entries = nano_pow::memory_to_entries (memory);
+	// Entries are interleaved across slabs
+	slab_size = nano_pow::entries_to_memory ((slab_entries + number_slabs - 1) / number_slabs);
 
 	if (verbose)
 	{
 		std::cout << "Memory set to " << number_slabs << " slab(s) of " << nano_pow::to_megabytes (slab_size) << "MB each" << std::endl;
 	}
+	memory_reset ();
+	if (number_slabs != program_slabs)
+	{
+		kernels_build (number_slabs);
+	}
 	try
 	{
-		memory_reset ();
 		fill_impl.setArg (0, slab_entries);
+		fill_staged_impl.setArg (0, slab_entries);
 		search_impl.setArg (0, slab_entries);
-		fill_impl.setArg (4, number_slabs);
-		search_impl.setArg (4, number_slabs);
 
 		for (unsigned i{ 0 }; i < number_slabs; ++i)
 		{
 			slabs.emplace_back (cl::Buffer (context, CL_MEM_READ_WRITE, slab_size));
-			search_impl.setArg (5 + i, slabs[i]);
-			fill_impl.setArg (5 + i, slabs[i]);
-		}
-		for (auto i{ number_slabs }; i < max_slabs; ++i)
-		{
-			search_impl.setArg (5 + i, nullptr);
-			fill_impl.setArg (5 + i, nullptr);
+			search_impl.setArg (7 + i, slabs[i]);
+			fill_impl.setArg (4 + i, slabs[i]);
+			fill_staged_impl.setArg (4 + i, slabs[i]);
 		}
 	}
 	catch (cl::Error const & err)
@@ -232,23 +563,51 @@ bool nano_pow::opencl_driver::memory_set (size_t memory)
 	return false;
 }
 
+size_t nano_pow::opencl_driver::memory_get () const
+{
+	return slabs.empty () ? 0 : nano_pow::entries_to_memory (slab_entries);
+}
+
 void nano_pow::opencl_driver::memory_reset ()
 {
 	slabs.clear ();
 	current_fill = 0;
 }
 
+nano_pow::profile_key nano_pow::opencl_driver::profile_key_get () const
+{
+	nano_pow::profile_key result;
+	result.driver = "opencl";
+	try
+	{
+		result.device = selected_device.getInfo<CL_DEVICE_NAME> ();
+		result.cores = selected_device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS> ();
+		result.memory = nano_pow::to_megabytes (global_mem_size);
+	}
+	catch (cl::Error const & err)
+	{
+		throw OCLDriverException (OCLDriverExceptionOrigin::init, err);
+	}
+	return result;
+}
+
 void nano_pow::opencl_driver::fill ()
 {
 	uint64_t current (current_fill);
-	uint32_t thread_count (this->threads);
+	uint64_t end (current_fill + slab_entries);
+	// The staged kernel runs in fixed size work-groups
+	auto staged (fill_staged && fill_staged_supported);
 	auto start = std::chrono::steady_clock::now ();
 	try
 	{
-		while (!cancel && current < current_fill + slab_entries)
+		while (!cancel.value && current < end)
 		{
-			fill_impl.setArg (3, static_cast<uint32_t> (current));
-			queue.enqueueNDRangeKernel (fill_impl, cl::NullRange, cl::NDRange (thread_count));
+			// The last launch only covers the entries remaining
+			auto thread_count (std::min<uint64_t> (threads, (end - current + stepping - 1) / stepping));
+			auto stage (staged && thread_count % fill_stage_size == 0);
+			auto & kernel (stage ? fill_staged_impl : fill_impl);
+			kernel.setArg (3, static_cast<uint32_t> (current));
+			queue.enqueueNDRangeKernel (kernel, cl::NullRange, cl::NDRange (thread_count), stage ? cl::NDRange (fill_stage_size) : cl::NullRange);
 			current += thread_count * stepping;
 		}
 		current_fill += slab_entries;
@@ -260,7 +619,7 @@ void nano_pow::opencl_driver::fill ()
 	}
 	if (verbose)
 	{
-		std::cout << "Filled " << slab_entries << " entries in " << std::chrono::duration_cast<std::chrono::milliseconds> (std::chrono::steady_clock::now () - start).count () << " ms" << std::endl;
+		std::cout << "Filled " << slab_entries << " entries " << (staged ? "(staged) " : "") << "in " << std::chrono::duration_cast<std::chrono::milliseconds> (std::chrono::steady_clock::now () - start).count () << " ms" << std::endl;
 	}
 }
 
@@ -269,20 +628,25 @@ std::array<uint64_t, 2> nano_pow::opencl_driver::search ()
 	std::array<cl::Event, 2> events;
 	uint64_t current (0);
 	std::array<uint64_t, 2> result = { 0, 0 };
-	uint32_t thread_count (this->threads);
 	auto start = std::chrono::steady_clock::now ();
 	size_t constexpr max_48bit{ (1ULL << 48) - 1 };
-	auto const max_current (max_48bit - thread_count * stepping);
 	try
 	{
-		while (!cancel && result[1] == 0 && current <= max_current)
+		// adaptive_set resets the stepping without updating the kernel
+		search_impl.setArg (2, search_stepping);
+		while (!cancel.value && result[1] == 0 && current <= max_48bit - static_cast<uint64_t> (search_threads) * search_stepping)
 		{
+			auto launch_start = std::chrono::steady_clock::now ();
 			search_impl.setArg (3, (current & max_48bit));
-			current += thread_count * stepping;
-			queue.enqueueNDRangeKernel (search_impl, cl::NullRange, cl::NDRange (thread_count));
+			current += static_cast<uint64_t> (search_threads) * search_stepping;
+			queue.enqueueNDRangeKernel (search_impl, cl::NullRange, cl::NDRange (search_threads));
 			queue.enqueueReadBuffer (result_buffer, false, 0, sizeof (uint64_t) * 2, &result, nullptr, &events[0]);
 			events[0].wait ();
 			events[0] = events[1];
+			if (adaptive)
+			{
+				launch_adapt (std::chrono::steady_clock::now () - launch_start);
+			}
 		}
 	}
 	catch (cl::Error const & err)
@@ -292,23 +656,93 @@ std::array<uint64_t, 2> nano_pow::opencl_driver::search ()
 	if (verbose)
 	{
 		std::cout << "Searched " << current << " nonces in " << std::chrono::duration_cast<std::chrono::milliseconds> (std::chrono::steady_clock::now () - start).count () << " ms" << std::endl;
+		if (adaptive)
+		{
+			std::cout << "Adapted to " << search_threads << " threads, stepping " << search_stepping << std::endl;
+		}
 	}
 	return result;
 }
 
+void nano_pow::opencl_driver::launch_adapt (std::chrono::steady_clock::duration const launch_a)
+{
+	// Grow the global size first to keep the device occupied, then the work per item
+	// Shrink in the reverse order
+	auto stepping_l (search_stepping);
+	if (launch_a < target_launch / 2)
+	{
+		if (search_threads < max_adaptive_threads)
+		{
+			search_threads *= 2;
+		}
+		else if (stepping_l < max_adaptive_stepping)
+		{
+			stepping_l *= 2;
+		}
+	}
+	else if (launch_a > target_launch * 2)
+	{
+		if (stepping_l > min_adaptive_stepping)
+		{
+			stepping_l /= 2;
+		}
+		else if (search_threads > min_adaptive_threads)
+		{
+			search_threads /= 2;
+		}
+	}
+	if (stepping_l != search_stepping)
+	{
+		search_stepping = stepping_l;
+		search_impl.setArg (2, search_stepping);
+	}
+}
+
 std::array<uint64_t, 2> nano_pow::opencl_driver::solve (std::array<uint64_t, 2> nonce)
 {
+	solve_begin ();
 	std::array<uint64_t, 2> result = { 0, 0 };
+	static uint32_t const found_none{ 0 };
 	try
 	{
 		queue.enqueueWriteBuffer (result_buffer, false, 0, sizeof (uint64_t) * 2, &result);
+		queue.enqueueWriteBuffer (found_buffer, false, 0, sizeof (uint32_t), &found_none);
 		queue.enqueueWriteBuffer (nonce_buffer, false, 0, sizeof (uint64_t) * 2, nonce.data ());
 	}
 	catch (cl::Error const & err)
 	{
 		throw OCLDriverException (OCLDriverExceptionOrigin::setup, err);
 	}
-	return nano_pow::driver::solve (nonce);
+	return solve_loop ();
+}
+
+void nano_pow::opencl_driver::adaptive_set (bool adaptive_a, std::chrono::milliseconds const target_launch_a)
+{
+	adaptive = adaptive_a;
+	target_launch = target_launch_a;
+	// Adapting starts again from the set threads and stepping
+	threads_set (threads);
+	search_stepping = stepping;
+}
+
+bool nano_pow::opencl_driver::adaptive_get () const
+{
+	return adaptive;
+}
+
+void nano_pow::opencl_driver::fill_staged_set (bool staged)
+{
+	fill_staged = staged;
+}
+
+bool nano_pow::opencl_driver::fill_staged_get () const
+{
+	return fill_staged;
+}
+
+bool nano_pow::opencl_driver::fill_staged_runs () const
+{
+	return fill_staged_supported && threads % fill_stage_size == 0;
 }
 
 void nano_pow::opencl_driver::dump () const
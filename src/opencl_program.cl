@@ -1,3 +1,10 @@
+// The host prepends the slab definitions for the number of slabs in use
+#ifndef SLAB_COUNT
+#define SLAB_COUNT 1
+#define SLAB_PARAMS , __global uint * slab_0
+#define SLAB_INIT(slabs) slabs[0] = slab_0;
+#endif
+
 static __constant ulong lhs_or_mask = ~(ulong) (LONG_MAX);
 static __constant ulong rhs_and_mask = LONG_MAX;
 typedef struct
@@ -227,6 +234,45 @@ static uint128_t hash (nonce_t const nonce_a, ulong const item_a)
 	return result;
 }
 
+/*
+ * Low word of hash, the first output word of SipHash-2-4 with a 16 byte output of a single 64 bit word
+ *
+ * Stops before the second finalization, for callers that only need the bucket or the low word of a sum
+ */
+static ulong hash_low (nonce_t const nonce_a, ulong const item_a)
+{
+	uint64_t v0 = 0x736f6d6570736575UL;
+	uint64_t v1 = 0x646f72616e646f6dUL;
+	uint64_t v2 = 0x6c7967656e657261UL;
+	uint64_t v3 = 0x7465646279746573UL;
+	uint64_t k0 = nonce_a.values[0];
+	uint64_t k1 = nonce_a.values[1];
+	uint64_t b = ((uint64_t)sizeof (item_a)) << 56;
+	int i;
+	v3 ^= k1;
+	v2 ^= k0;
+	v1 ^= k1;
+	v0 ^= k0;
+
+	v1 ^= 0xee;
+
+	v3 ^= item_a;
+	for (i = 0; i < cROUNDS; ++i)
+		SIPROUND;
+	v0 ^= item_a;
+
+	v3 ^= b;
+	for (i = 0; i < cROUNDS; ++i)
+		SIPROUND;
+	v0 ^= b;
+
+	v2 ^= 0xee;
+	for (i = 0; i < dROUNDS; ++i)
+		SIPROUND;
+
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
 static uint128_t H0 (nonce_t nonce_a, ulong const item_a)
 {
 	return hash (lhs_nonce (nonce_a), item_a);
@@ -237,12 +283,31 @@ static uint128_t H1 (nonce_t nonce_a, ulong const item_a)
 	return hash (rhs_nonce (nonce_a), item_a);
 }
 
+static ulong H0_low (nonce_t nonce_a, ulong const item_a)
+{
+	return hash_low (lhs_nonce (nonce_a), item_a);
+}
+
+static ulong H1_low (nonce_t nonce_a, ulong const item_a)
+{
+	return hash_low (rhs_nonce (nonce_a), item_a);
+}
+
 static bool passes_quick (uint128_t const sum_a, uint128_t const difficulty_inv_a)
 {
 	bool passed = ((sum_a.high & difficulty_inv_a.high) == 0) & ((sum_a.low & difficulty_inv_a.low) == 0);
 	return passed;
 }
 
+// Trailing ones of threshold_a, the reversed leading ones of the difficulty. Their bits of the sum are 0 for every solution
+static uint128_t quick_mask (uint128_t const threshold_a)
+{
+	uint128_t result;
+	result.low = threshold_a.low & ~(threshold_a.low + 1);
+	result.high = threshold_a.low == 0xffffffffffffffff ? threshold_a.high & ~(threshold_a.high + 1) : 0;
+	return result;
+}
+
 static ulong reverse_64 (ulong const item_a)
 {
 	ulong result = item_a;
@@ -269,21 +334,28 @@ static bool passes_sum (uint128_t const sum_a, uint128_t const threshold_a)
 	return passed;
 }
 
+// Maps item_a to an index below size_a from its low ceil(log2 (size_a)) bits, the same as masking for a power of 2 size
+static ulong table_index (ulong const size_a, ulong const item_a)
+{
+	uint const shift = size_a > 1 ? clz (size_a - 1) : 63;
+	return mul_hi (item_a << shift, size_a);
+}
+
 static uint slab (uint const slabs_a, ulong const size_a, ulong const item_a)
 {
-	ulong mask = size_a - 1;
-	return (item_a & mask) % slabs_a;
+	return table_index (size_a, item_a) % slabs_a;
 }
 
 static ulong bucket (uint const slabs_a, ulong const size_a, ulong const item_a)
 {
-	ulong mask = size_a - 1;
-	return (item_a & mask) / slabs_a;
+	return table_index (size_a, item_a) / slabs_a;
 }
 
-__kernel void search (ulong const size_a, __global ulong * const nonce_a, uint const count_a, ulong const begin_a, uint const slabs_a,
-__global uint * const slab_0, __global uint * const slab_1, __global uint * const slab_2, __global uint * const slab_3,
-uint128_t const threshold_a, __global ulong * result_a)
+// Iterations between checks of the found flag in search, must be a power of 2
+#define SEARCH_FOUND_CHECK 64
+
+__kernel void search (ulong const size_a, __global ulong * const nonce_a, uint const count_a, ulong const begin_a,
+uint128_t const threshold_a, __global ulong * result_a, __global volatile uint * found_a SLAB_PARAMS)
 {
 	//printf ("[%llu] Search (%llx%llx) size %llu begin %lu count %lu\n", get_global_id (0), threshold_a.high, threshold_a.low, size_a, begin_a, count_a);
 	bool incomplete = true;
@@ -293,49 +365,124 @@ uint128_t const threshold_a, __global ulong * result_a)
 	nonce_l.values[0] = nonce_a[0];
 	nonce_l.values[1] = nonce_a[1];
 	// Local array of pointers to global memory, ~2% better performance than using a global array
-	__global uint * __local slabs[4];
-	slabs[0] = slab_0;
-	slabs[1] = slab_1;
-	slabs[2] = slab_2;
-	slabs[3] = slab_3;
+	__global uint * __local slabs[SLAB_COUNT];
+	SLAB_INIT (slabs);
+	// Only the leading ones of the difficulty are checked quickly, passes_sum compares the rest
+	uint128_t const quick_l = quick_mask (threshold_a);
+	// Difficulties with up to 64 leading ones only need the low words of the hashes until the quick check passes
+	bool const low_only = quick_l.high == 0;
 	for (ulong current = begin_a + get_global_id (0) * count_a, end = current + count_a; incomplete && current < end; ++current)
 	{
+		// Stop early once any work-item has claimed the result
+		if ((current & (SEARCH_FOUND_CHECK - 1)) == 0 && *found_a != 0)
+		{
+			break;
+		}
 		rhs = current;
-		uint128_t const hash_l = H1 (nonce_l, rhs);
-		uint const slab_l = slab (slabs_a, size_a, 0 - hash_l.low);
-		ulong const bucket_l = bucket (slabs_a, size_a, 0 - hash_l.low);
+		uint128_t hash_l;
+		if (low_only)
+		{
+			hash_l.low = H1_low (nonce_l, rhs);
+			hash_l.high = 0;
+		}
+		else
+		{
+			hash_l = H1 (nonce_l, rhs);
+		}
+		uint const slab_l = slab (SLAB_COUNT, size_a, 0 - hash_l.low);
+		ulong const bucket_l = bucket (SLAB_COUNT, size_a, 0 - hash_l.low);
 		//printf("%llu %llu %lu --- %llu\n", size_a, 0 - hash_l, slab_l, (0 - hash_l) & (size_a - 1));
 		lhs = slabs[slab_l][bucket_l];
-		uint128_t summ = sum (H0 (nonce_l, lhs), hash_l);
-		//printf ("%lu %lx %lu %lx\n", lhs, hash_l, rhs, summ);
-		incomplete = !passes_quick (summ, threshold_a) || !passes_sum (summ, reverse (threshold_a));
+		if (low_only)
+		{
+			// The high words are only hashed for the rare candidates
+			incomplete = ((H0_low (nonce_l, lhs) + hash_l.low) & quick_l.low) != 0 || !passes_sum (sum (H0 (nonce_l, lhs), H1 (nonce_l, rhs)), reverse (threshold_a));
+		}
+		else
+		{
+			uint128_t summ = sum (H0 (nonce_l, lhs), hash_l);
+			//printf ("%lu %lx %lu %lx\n", lhs, hash_l, rhs, summ);
+			incomplete = !passes_quick (summ, quick_l) || !passes_sum (summ, reverse (threshold_a));
+		}
 	}
-	if (!incomplete)
+	// Only the first solution is written so the result cannot mix two solutions
+	if (!incomplete && atomic_cmpxchg (found_a, 0, 1) == 0)
 	{
 		result_a[0] = (ulong)lhs;
 		result_a[1] = rhs;
 	}
 }
 
-__kernel void fill (ulong const size_a, __global ulong * const nonce_a, uint const count_a, uint const begin_a, uint const slabs_a,
-__global uint * slab_0, __global uint * slab_1, __global uint * slab_2, __global uint * slab_3)
+__kernel void fill (ulong const size_a, __global ulong * const nonce_a, uint const count_a, uint const begin_a SLAB_PARAMS)
 {
 	//printf ("[%llu] Fill size %llu begin %lu count %lu\n", get_global_id (0), size_a, begin_a, count_a);
 	nonce_t nonce_l;
 	nonce_l.values[0] = nonce_a[0];
 	nonce_l.values[1] = nonce_a[1];
 	// Local array of pointers to global memory, ~2% better performance than using a global array
-	__global uint * __local slabs[4];
-	slabs[0] = slab_0;
-	slabs[1] = slab_1;
-	slabs[2] = slab_2;
-	slabs[3] = slab_3;
+	__global uint * __local slabs[SLAB_COUNT];
+	SLAB_INIT (slabs);
 	for (uint current = begin_a + get_global_id (0) * count_a, end = current + count_a; current < end; ++current)
 	{
-		uint128_t const hash_l = H0 (nonce_l, current);
-		uint const slab_l = slab (slabs_a, size_a, hash_l.low);
-		ulong const bucket_l = bucket (slabs_a, size_a, hash_l.low);
+		ulong const hash_l = H0_low (nonce_l, current);
+		uint const slab_l = slab (SLAB_COUNT, size_a, hash_l);
+		ulong const bucket_l = bucket (SLAB_COUNT, size_a, hash_l);
 		slabs[slab_l][bucket_l] = current;
 		//printf ("[%llu] Writing current %lu to slab %lu bucket %llu\n", get_global_id (0), current, slab_l, bucket_l);
 	}
 }
+
+// Work-group size of fill_staged, must match opencl_driver::fill_stage_size
+#define FILL_STAGE 256
+// Number of destination regions each work-group bins its outputs into
+#define FILL_REGIONS 16
+
+/*
+ * Same output as fill, but each round the work-group bins its items in local memory by destination region
+ * and writes them out in region order, so neighbouring work-items store to nearby addresses
+ */
+__kernel void fill_staged (ulong const size_a, __global ulong * const nonce_a, uint const count_a, uint const begin_a SLAB_PARAMS)
+{
+	__local uint stage_items[FILL_STAGE];
+	__local ulong stage_indices[FILL_STAGE];
+	__local uint region_counts[FILL_REGIONS];
+	__local uint region_offsets[FILL_REGIONS];
+	nonce_t nonce_l;
+	nonce_l.values[0] = nonce_a[0];
+	nonce_l.values[1] = nonce_a[1];
+	__global uint * __local slabs[SLAB_COUNT];
+	SLAB_INIT (slabs);
+	uint const local_id = get_local_id (0);
+	uint const size_bits = size_a > 1 ? 64 - clz (size_a - 1) : 0;
+	uint const region_shift = size_bits > 4 ? size_bits - 4 : 0;
+	uint current = begin_a + get_global_id (0) * count_a;
+	for (uint i = 0; i < count_a; ++i, ++current)
+	{
+		if (local_id < FILL_REGIONS)
+		{
+			region_counts[local_id] = 0;
+		}
+		barrier (CLK_LOCAL_MEM_FENCE);
+		ulong const index_l = table_index (size_a, H0_low (nonce_l, current));
+		uint const region_l = (uint) (index_l >> region_shift) & (FILL_REGIONS - 1);
+		uint const rank_l = atomic_inc (&region_counts[region_l]);
+		barrier (CLK_LOCAL_MEM_FENCE);
+		if (local_id == 0)
+		{
+			uint offset = 0;
+			for (uint region = 0; region < FILL_REGIONS; ++region)
+			{
+				region_offsets[region] = offset;
+				offset += region_counts[region];
+			}
+		}
+		barrier (CLK_LOCAL_MEM_FENCE);
+		uint const position_l = region_offsets[region_l] + rank_l;
+		stage_items[position_l] = current;
+		stage_indices[position_l] = index_l;
+		barrier (CLK_LOCAL_MEM_FENCE);
+		ulong const index_out = stage_indices[local_id];
+		slabs[index_out % SLAB_COUNT][index_out / SLAB_COUNT] = stage_items[local_id];
+		barrier (CLK_LOCAL_MEM_FENCE);
+	}
+}
@@ -0,0 +1,144 @@
+#include <nano_pow/pow.hpp>
+#include <nano_pow/profile.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+namespace
+{
+char const * const profile_header{ "nano_pow_profiles" };
+}
+
+bool nano_pow::profile_key::operator== (nano_pow::profile_key const & other_a) const
+{
+	return driver == other_a.driver && device == other_a.device && cores == other_a.cores && memory == other_a.memory && band == other_a.band;
+}
+
+bool nano_pow::profiles::load (std::string const & path_a)
+{
+	entries.clear ();
+	std::ifstream stream (path_a);
+	std::string line;
+	bool error (!std::getline (stream, line));
+	if (!error)
+	{
+		std::istringstream header (line);
+		std::string name;
+		unsigned version_l{ 0 };
+		header >> name >> version_l;
+		error = header.fail () || name != profile_header || version_l != version;
+	}
+	while (!error && std::getline (stream, line))
+	{
+		if (line.empty ())
+		{
+			continue;
+		}
+		// The device name may contain spaces, fields are separated by tabs
+		std::vector<std::string> fields;
+		std::istringstream line_stream (line);
+		for (std::string field; std::getline (line_stream, field, '\t');)
+		{
+			fields.push_back (field);
+		}
+		nano_pow::profile profile_l;
+		error = fields.size () != 8;
+		if (!error)
+		{
+			profile_l.key.driver = fields[0];
+			profile_l.key.device = fields[1];
+			std::istringstream numbers (fields[2] + ' ' + fields[3] + ' ' + fields[4] + ' ' + fields[5] + ' ' + fields[6] + ' ' + fields[7]);
+			numbers >> profile_l.key.cores >> profile_l.key.memory >> profile_l.key.band >> profile_l.memory >> profile_l.threads >> profile_l.stepping;
+			error = numbers.fail () || profile_l.memory == 0 || profile_l.threads == 0 || profile_l.stepping == 0;
+		}
+		if (!error)
+		{
+			put (profile_l);
+		}
+	}
+	if (error)
+	{
+		entries.clear ();
+	}
+	return error;
+}
+
+bool nano_pow::profiles::save (std::string const & path_a) const
+{
+	// Written aside and renamed so readers never see a partial file
+	auto temporary (path_a + ".tmp");
+	bool error{ false };
+	{
+		std::ofstream stream (temporary, std::ios::trunc);
+		stream << profile_header << ' ' << version << '\n';
+		for (auto const & profile_l : entries)
+		{
+			stream << profile_l.key.driver << '\t' << profile_l.key.device << '\t' << profile_l.key.cores << '\t' << profile_l.key.memory << '\t' << profile_l.key.band << '\t' << profile_l.memory << '\t' << profile_l.threads << '\t' << profile_l.stepping << '\n';
+		}
+		stream.flush ();
+		error = !stream;
+	}
+	if (!error)
+	{
+		// rename does not replace an existing file on Windows
+		std::remove (path_a.c_str ());
+		error = std::rename (temporary.c_str (), path_a.c_str ()) != 0;
+	}
+	if (error)
+	{
+		std::remove (temporary.c_str ());
+	}
+	return error;
+}
+
+void nano_pow::profiles::put (nano_pow::profile const & profile_a)
+{
+	auto existing (std::find_if (entries.begin (), entries.end (), [&profile_a](nano_pow::profile const & profile_l) { return profile_l.key == profile_a.key; }));
+	if (existing != entries.end ())
+	{
+		*existing = profile_a;
+	}
+	else
+	{
+		entries.push_back (profile_a);
+	}
+}
+
+nano_pow::profile const * nano_pow::profiles::find (nano_pow::profile_key const & key_a) const
+{
+	auto existing (std::find_if (entries.begin (), entries.end (), [&key_a](nano_pow::profile const & profile_l) { return profile_l.key == key_a; }));
+	return existing != entries.end () ? &*existing : nullptr;
+}
+
+unsigned nano_pow::profile_band (nano_pow::uint128_t difficulty_a)
+{
+	return nano_pow::difficulty_bits (difficulty_a) / 4;
+}
+
+std::string nano_pow::profile_default_path ()
+{
+	std::string result;
+	if (auto path = std::getenv ("NANO_POW_PROFILE"))
+	{
+		result = path;
+	}
+#ifdef _WIN32
+	else if (auto app_data = std::getenv ("APPDATA"))
+	{
+		result = std::string (app_data) + "\\nano_pow_profiles";
+	}
+#else
+	else if (auto home = std::getenv ("HOME"))
+	{
+		result = std::string (home) + "/.nano_pow_profiles";
+	}
+#endif
+	else
+	{
+		result = "nano_pow_profiles";
+	}
+	return result;
+}
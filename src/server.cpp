@@ -0,0 +1,608 @@
+#include <nano_pow/pow.hpp>
+#include <nano_pow/server.hpp>
+
+#include <cctype>
+#include <cstring>
+#include <iomanip>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+/* No MSG_NOSIGNAL on macOS, SO_NOSIGPIPE is set on the socket instead */
+#define MSG_NOSIGNAL (0)
+#endif
+
+namespace
+{
+// Interval at which blocking socket calls check for stop
+int constexpr poll_interval_ms{ 100 };
+size_t constexpr max_request_size{ 4096 };
+// Unanswered work_generate requests per connection
+size_t constexpr max_generates{ 256 };
+// Requests are queued one priority above hints, see work_cache::solve
+uint64_t constexpr max_priority{ std::numeric_limits<unsigned>::max () - 1 };
+
+/*
+ * Parses a flat JSON object into `values_a`
+ *
+ * Values are kept as their JSON text, strings with their quotes. Nested objects and arrays are rejected
+ * Returns true on error
+ */
+bool json_parse (std::string const & text_a, std::map<std::string, std::string> & values_a)
+{
+	size_t i{ 0 };
+	auto skip = [&]() {
+		while (i < text_a.size () && std::isspace (static_cast<unsigned char> (text_a[i])))
+		{
+			++i;
+		}
+	};
+	auto string_end = [&](size_t begin_a) {
+		auto end (begin_a + 1);
+		while (end < text_a.size () && text_a[end] != '"')
+		{
+			end += text_a[end] == '\\' ? 2 : 1;
+		}
+		return end;
+	};
+	skip ();
+	bool error (i >= text_a.size () || text_a[i] != '{');
+	++i;
+	skip ();
+	if (!error && i < text_a.size () && text_a[i] == '}')
+	{
+		++i;
+	}
+	else
+	{
+		while (!error)
+		{
+			skip ();
+			error = i >= text_a.size () || text_a[i] != '"';
+			if (!error)
+			{
+				auto key_end (string_end (i));
+				auto key (text_a.substr (i + 1, key_end - i - 1));
+				i = key_end + 1;
+				skip ();
+				error = i >= text_a.size () || text_a[i] != ':';
+				++i;
+				skip ();
+				size_t value_begin (i);
+				if (!error && i < text_a.size () && text_a[i] == '"')
+				{
+					i = string_end (i) + 1;
+				}
+				else
+				{
+					while (i < text_a.size () && text_a[i] != ',' && text_a[i] != '}' && !std::isspace (static_cast<unsigned char> (text_a[i])))
+					{
+						++i;
+					}
+				}
+				error = error || i > text_a.size () || i == value_begin || text_a[value_begin] == '{' || text_a[value_begin] == '[';
+				if (!error)
+				{
+					values_a[key] = text_a.substr (value_begin, i - value_begin);
+					skip ();
+					error = i >= text_a.size () || (text_a[i] != ',' && text_a[i] != '}');
+				}
+				if (!error && text_a[i++] == '}')
+				{
+					break;
+				}
+			}
+		}
+	}
+	skip ();
+	return error || i != text_a.size ();
+}
+
+// Unquotes a JSON string value, returns true on error
+bool json_string (std::string const & value_a, std::string & result_a)
+{
+	bool error (value_a.size () < 2 || value_a.front () != '"' || value_a.back () != '"');
+	if (!error)
+	{
+		result_a.clear ();
+		for (size_t i (1), n (value_a.size () - 1); i < n; ++i)
+		{
+			if (value_a[i] == '\\' && i + 1 < n)
+			{
+				++i;
+			}
+			result_a.push_back (value_a[i]);
+		}
+	}
+	return error;
+}
+
+std::string json_quote (std::string const & value_a)
+{
+	std::string result ("\"");
+	for (auto c : value_a)
+	{
+		if (c == '"' || c == '\\')
+		{
+			result.push_back ('\\');
+		}
+		result.push_back (c);
+	}
+	result.push_back ('"');
+	return result;
+}
+
+std::string to_hex64 (uint64_t value_a)
+{
+	std::ostringstream stream;
+	stream << std::hex << std::noshowbase << std::setw (16) << std::setfill ('0') << value_a;
+	return stream.str ();
+}
+
+// Parses `words_a` 64 bit words written as 16 hex digits each, returns true on error
+bool from_hex (std::string const & text_a, size_t const words_a, std::array<uint64_t, 2> & result_a)
+{
+	bool error (text_a.size () != words_a * 16 || text_a.find_first_not_of ("0123456789abcdefABCDEF") != std::string::npos);
+	for (size_t i (0); !error && i < words_a; ++i)
+	{
+		result_a[i] = std::stoull (text_a.substr (i * 16, 16), nullptr, 16);
+	}
+	return error;
+}
+
+// A string field of 16 or 32 hex digits, 64 bit difficulties are widened as by difficulty_64_to_128
+bool difficulty_parse (std::string const & text_a, nano_pow::uint128_t & result_a)
+{
+	std::array<uint64_t, 2> words{ { 0, 0 } };
+	bool error (true);
+	if (text_a.size () == 16)
+	{
+		error = from_hex (text_a, 1, words);
+		result_a = nano_pow::difficulty_64_to_128 (words[0]);
+	}
+	else if (text_a.size () == 32)
+	{
+		error = from_hex (text_a, 2, words);
+		result_a = (static_cast<nano_pow::uint128_t> (words[0]) << 64) | words[1];
+	}
+	return error;
+}
+
+bool number_parse (std::string const & text_a, uint64_t & result_a)
+{
+	bool error (text_a.empty () || text_a.find_first_not_of ("0123456789") != std::string::npos || text_a.size () > 19);
+	if (!error)
+	{
+		result_a = std::stoull (text_a);
+	}
+	return error;
+}
+
+class request
+{
+public:
+	std::map<std::string, std::string> values;
+	// Returns true if the field is missing or not a string
+	bool string (std::string const & key_a, std::string & result_a) const
+	{
+		auto existing (values.find (key_a));
+		return existing == values.end () || json_string (existing->second, result_a);
+	}
+	// Returns true if the field is present but not a number
+	bool number (std::string const & key_a, uint64_t & result_a) const
+	{
+		auto existing (values.find (key_a));
+		return existing != values.end () && number_parse (existing->second, result_a);
+	}
+};
+
+std::string generate_response (nano_pow::server::session::generate const & generate_a)
+{
+	std::string result;
+	try
+	{
+		auto solution (generate_a.result.get ());
+		if (solution[1] != 0)
+		{
+			auto achieved (nano_pow::difficulty (generate_a.nonce, solution));
+			result = generate_a.prefix + "\"work\":\"" + to_hex64 (solution[0]) + to_hex64 (solution[1]) + "\",\"difficulty\":\"" + to_hex64 (static_cast<uint64_t> (achieved >> 64)) + to_hex64 (static_cast<uint64_t> (achieved)) + "\"}";
+		}
+		else
+		{
+			result = generate_a.prefix + "\"error\":\"Cancelled\"}";
+		}
+	}
+	catch (std::exception const & err)
+	{
+		result = generate_a.prefix + "\"error\":" + json_quote (err.what ()) + "}";
+	}
+	return result;
+}
+
+void send_all (int socket_a, std::string const & data_a)
+{
+	for (size_t sent (0); sent < data_a.size ();)
+	{
+		auto result (::send (socket_a, data_a.data () + sent, data_a.size () - sent, MSG_NOSIGNAL));
+		if (result <= 0)
+		{
+			break;
+		}
+		sent += static_cast<size_t> (result);
+	}
+}
+}
+
+nano_pow::server::server (nano_pow::work_cache & cache_a) :
+cache (cache_a)
+{
+}
+
+nano_pow::server::~server ()
+{
+	stop ();
+}
+
+bool nano_pow::server::listen_tcp (uint16_t port_a)
+{
+	listener = ::socket (AF_INET, SOCK_STREAM, 0);
+	bool error (listener < 0);
+	if (!error)
+	{
+		int reuse{ 1 };
+		(void)::setsockopt (listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof (reuse));
+		sockaddr_in address;
+		std::memset (&address, 0, sizeof (address));
+		address.sin_family = AF_INET;
+		address.sin_port = htons (port_a);
+		address.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+		socklen_t length (sizeof (address));
+		error = ::bind (listener, reinterpret_cast<sockaddr *> (&address), sizeof (address)) != 0 || ::listen (listener, SOMAXCONN) != 0 || ::getsockname (listener, reinterpret_cast<sockaddr *> (&address), &length) != 0;
+		port = ntohs (address.sin_port);
+	}
+	return error;
+}
+
+bool nano_pow::server::listen_unix (std::string const & path_a)
+{
+	sockaddr_un address;
+	std::memset (&address, 0, sizeof (address));
+	bool error (path_a.size () >= sizeof (address.sun_path));
+	if (!error)
+	{
+		listener = ::socket (AF_UNIX, SOCK_STREAM, 0);
+		error = listener < 0;
+	}
+	if (!error)
+	{
+		// A socket file left by a previous run would fail the bind
+		::unlink (path_a.c_str ());
+		address.sun_family = AF_UNIX;
+		std::strncpy (address.sun_path, path_a.c_str (), sizeof (address.sun_path) - 1);
+		error = ::bind (listener, reinterpret_cast<sockaddr *> (&address), sizeof (address)) != 0 || ::listen (listener, SOMAXCONN) != 0;
+		unix_path = path_a;
+	}
+	return error;
+}
+
+uint16_t nano_pow::server::port_get () const
+{
+	return port;
+}
+
+void nano_pow::server::start ()
+{
+	stopped = false;
+	acceptor = std::thread ([this]() { accept_loop (); });
+}
+
+void nano_pow::server::stop ()
+{
+	stopped = true;
+	if (acceptor.joinable ())
+	{
+		acceptor.join ();
+	}
+	for (auto & connection_l : connections)
+	{
+		connection_l->thread.join ();
+	}
+	connections.clear ();
+	if (listener >= 0)
+	{
+		::close (listener);
+		listener = -1;
+	}
+	if (!unix_path.empty ())
+	{
+		::unlink (unix_path.c_str ());
+		unix_path.clear ();
+	}
+}
+
+void nano_pow::server::accept_loop ()
+{
+	while (!stopped)
+	{
+		pollfd descriptor{ listener, POLLIN, 0 };
+		if (::poll (&descriptor, 1, poll_interval_ms) > 0)
+		{
+			auto socket_l (::accept (listener, nullptr, nullptr));
+			if (socket_l >= 0)
+			{
+#ifdef SO_NOSIGPIPE
+				int no_sigpipe{ 1 };
+				(void)::setsockopt (socket_l, SOL_SOCKET, SO_NOSIGPIPE, &no_sigpipe, sizeof (no_sigpipe));
+#endif
+				connections.push_back (std::make_unique<connection> ());
+				auto & connection_l (*connections.back ());
+				connection_l.socket = socket_l;
+				connection_l.thread = std::thread ([this, &connection_l]() { connection_loop (connection_l); });
+			}
+		}
+		// Reap closed connections
+		for (auto i (connections.begin ()); i != connections.end ();)
+		{
+			if ((*i)->done)
+			{
+				(*i)->thread.join ();
+				i = connections.erase (i);
+			}
+			else
+			{
+				++i;
+			}
+		}
+	}
+}
+
+void nano_pow::server::connection_loop (connection & connection_a)
+{
+	std::mutex write_mutex;
+	// Shared with the completion callbacks given to the cache, which may outlive the connection
+	auto session_l (std::make_shared<session> ());
+	session_l->respond = [&connection_a, &write_mutex](std::string const & response_a) {
+		std::lock_guard<std::mutex> lock (write_mutex);
+		send_all (connection_a.socket, response_a + '\n');
+	};
+	session_l->waiter = std::thread ([this, session_l]() { wait (*session_l); });
+	std::string buffer;
+	std::array<char, 4096> chunk;
+	bool closed{ false };
+	while (!stopped && !closed)
+	{
+		pollfd descriptor{ connection_a.socket, POLLIN, 0 };
+		if (::poll (&descriptor, 1, poll_interval_ms) > 0)
+		{
+			auto received (::recv (connection_a.socket, chunk.data (), chunk.size (), 0));
+			closed = received <= 0;
+			if (!closed)
+			{
+				buffer.append (chunk.data (), static_cast<size_t> (received));
+				for (auto end (buffer.find ('\n')); end != std::string::npos; end = buffer.find ('\n'))
+				{
+					auto line (buffer.substr (0, end));
+					buffer.erase (0, end + 1);
+					if (!line.empty () && line.back () == '\r')
+					{
+						line.pop_back ();
+					}
+					if (!line.empty ())
+					{
+						handle (line, session_l);
+					}
+				}
+				if (buffer.size () > max_request_size)
+				{
+					session_l->respond ("{\"error\":\"Request too large\"}");
+					closed = true;
+				}
+			}
+		}
+	}
+	// Nobody is left to receive the solutions
+	close (*session_l);
+	::close (connection_a.socket);
+	connection_a.done = true;
+}
+
+void nano_pow::server::session::notify ()
+{
+	{
+		std::lock_guard<std::mutex> lock (mutex);
+		++completions;
+	}
+	condition.notify_all ();
+}
+
+void nano_pow::server::wait (session & session_a)
+{
+	std::unique_lock<std::mutex> lock (session_a.mutex);
+	uint64_t seen{ 0 };
+	while (!session_a.closed)
+	{
+		seen = session_a.completions;
+		std::list<session::generate> ready;
+		for (auto i (session_a.generates.begin ()); i != session_a.generates.end ();)
+		{
+			auto current (i++);
+			if (current->result.wait_for (std::chrono::seconds (0)) == std::future_status::ready)
+			{
+				ready.splice (ready.end (), session_a.generates, current);
+			}
+		}
+		if (!ready.empty ())
+		{
+			// Responses are written without the lock, work_cancel can no longer claim these
+			lock.unlock ();
+			for (auto const & generate_l : ready)
+			{
+				session_a.respond (generate_response (generate_l));
+			}
+			lock.lock ();
+		}
+		session_a.condition.wait (lock, [&session_a, &seen]() { return session_a.closed || session_a.completions != seen; });
+	}
+}
+
+void nano_pow::server::close (session & session_a)
+{
+	std::list<session::generate> abandoned;
+	{
+		std::lock_guard<std::mutex> lock (session_a.mutex);
+		session_a.closed = true;
+		abandoned.swap (session_a.generates);
+	}
+	session_a.condition.notify_all ();
+	session_a.waiter.join ();
+	for (auto const & generate_l : abandoned)
+	{
+		cache.cancel (generate_l.nonce);
+	}
+}
+
+void nano_pow::server::handle (std::string const & request_a, std::shared_ptr<session> const & session_a)
+{
+	auto & respond_a (session_a->respond);
+	request request_l;
+	std::string prefix ("{");
+	auto error = [&respond_a, &prefix](std::string const & message_a) {
+		respond_a (prefix + "\"error\":" + json_quote (message_a) + "}");
+	};
+	std::string action;
+	if (json_parse (request_a, request_l.values))
+	{
+		error ("Malformed request");
+	}
+	else if (request_l.string ("action", action))
+	{
+		error ("Missing action");
+	}
+	else
+	{
+		auto id (request_l.values.find ("id"));
+		if (id != request_l.values.end ())
+		{
+			prefix += "\"id\":" + id->second + ",";
+		}
+		prefix += "\"action\":" + json_quote (action) + ",";
+		std::string nonce_text;
+		std::array<uint64_t, 2> nonce{ { 0, 0 } };
+		std::string difficulty_text;
+		nano_pow::uint128_t difficulty{ 0 };
+		if (request_l.string ("nonce", nonce_text) || from_hex (nonce_text, 2, nonce))
+		{
+			error ("Invalid nonce");
+		}
+		else if (action == "work_generate")
+		{
+			uint64_t priority{ 0 };
+			uint64_t timeout{ 0 };
+			size_t unanswered{ 0 };
+			{
+				std::lock_guard<std::mutex> lock (session_a->mutex);
+				unanswered = session_a->generates.size ();
+			}
+			if (request_l.string ("difficulty", difficulty_text) || difficulty_parse (difficulty_text, difficulty))
+			{
+				error ("Invalid difficulty");
+			}
+			else if (request_l.number ("priority", priority) || request_l.number ("timeout", timeout) || priority > max_priority)
+			{
+				error ("Invalid priority or timeout");
+			}
+			else if (unanswered >= max_generates)
+			{
+				error ("Too many requests");
+			}
+			else
+			{
+				auto deadline (timeout != 0 ? nano_pow::work_queue::clock::now () + std::chrono::milliseconds (timeout) : nano_pow::work_queue::clock::time_point::max ());
+				session::generate generate_l;
+				generate_l.nonce = nonce;
+				generate_l.prefix = prefix;
+				generate_l.result = cache.solve (nonce, difficulty, static_cast<unsigned> (priority), deadline, [session_a]() { session_a->notify (); });
+				if (generate_l.result.wait_for (std::chrono::seconds (0)) == std::future_status::ready)
+				{
+					respond_a (generate_response (generate_l));
+				}
+				else
+				{
+					{
+						std::lock_guard<std::mutex> lock (session_a->mutex);
+						session_a->generates.push_back (std::move (generate_l));
+					}
+					// The solve may have completed before it was added
+					session_a->notify ();
+				}
+			}
+		}
+		else if (action == "work_validate")
+		{
+			std::string work_text;
+			std::array<uint64_t, 2> work{ { 0, 0 } };
+			if (request_l.string ("work", work_text) || from_hex (work_text, 2, work))
+			{
+				error ("Invalid work");
+			}
+			else if (request_l.string ("difficulty", difficulty_text) || difficulty_parse (difficulty_text, difficulty))
+			{
+				error ("Invalid difficulty");
+			}
+			else
+			{
+				auto achieved (nano_pow::difficulty (nonce, work));
+				// Solutions are limited to 32 + 48 bits
+				auto valid (work[0] <= std::numeric_limits<uint32_t>::max () && work[1] <= (1ULL << 48) - 1 && nano_pow::passes (nonce, work, difficulty));
+				respond_a (prefix + "\"valid\":" + (valid ? "true" : "false") + ",\"difficulty\":\"" + to_hex64 (static_cast<uint64_t> (achieved >> 64)) + to_hex64 (static_cast<uint64_t> (achieved)) + "\"}");
+			}
+		}
+		else if (action == "work_cancel")
+		{
+			// Only this connection's requests are cancelled, others for the same nonce keep their solve
+			std::list<session::generate> cancelled;
+			{
+				std::lock_guard<std::mutex> lock (session_a->mutex);
+				for (auto i (session_a->generates.begin ()); i != session_a->generates.end ();)
+				{
+					auto current (i++);
+					if (current->nonce == nonce)
+					{
+						cancelled.splice (cancelled.end (), session_a->generates, current);
+					}
+				}
+			}
+			for (auto const & generate_l : cancelled)
+			{
+				cache.cancel (nonce);
+				respond_a (generate_l.prefix + "\"error\":\"Cancelled\"}");
+			}
+			respond_a (prefix + "\"cancelled\":" + (cancelled.empty () ? "false" : "true") + "}");
+		}
+		else if (action == "work_precompute")
+		{
+			if (request_l.string ("difficulty", difficulty_text) || difficulty_parse (difficulty_text, difficulty))
+			{
+				error ("Invalid difficulty");
+			}
+			else
+			{
+				cache.precompute (nonce, difficulty);
+				respond_a (prefix + "\"queued\":true}");
+			}
+		}
+		else
+		{
+			error ("Unknown action");
+		}
+	}
+}
@@ -0,0 +1,138 @@
+#include <nano_pow/conversions.hpp>
+#include <nano_pow/cpp_driver.hpp>
+#include <nano_pow/opencl_driver.hpp>
+#include <nano_pow/profile.hpp>
+#include <nano_pow/server.hpp>
+#include <nano_pow/work_cache.hpp>
+#include <nano_pow/work_queue.hpp>
+
+#include <cxxopts.hpp>
+
+#include <atomic>
+#include <csignal>
+#include <iostream>
+
+namespace
+{
+std::atomic<bool> interrupted{ false };
+void interrupt (int)
+{
+	interrupted = true;
+}
+}
+
+int main (int argc, char ** argv)
+{
+	cxxopts::Options options ("nano_pow_server", "Command line options");
+	options.add_options ()
+	// clang-format off
+		("driver", "Specify which driver to use", cxxopts::value<std::string>()->default_value("cpp"), "cpp|opencl")
+		("port", "Loopback TCP port to listen on, default: 7090", cxxopts::value<uint16_t>()->default_value("7090"))
+		("unix", "Listen on a Unix domain socket at <path> instead of TCP", cxxopts::value<std::string>())
+		("cache", "Number of solutions kept for repeated and precomputed nonces, default: 4096", cxxopts::value<size_t>()->default_value("4096"))
+		("t,threads", "Number of device threads to use to find solutions", cxxopts::value<unsigned>())
+		("l,lookup", "Scale of lookup table (N) allocated at startup. Table contains 2^N entries", cxxopts::value<unsigned>())
+		("platform", "Defines the <platform> for OpenCL driver", cxxopts::value<unsigned short>())
+		("device", "Defines <device> for OpenCL driver", cxxopts::value<unsigned short>())
+		("profile", "Tuning profile file applied as requests change difficulty band, default: NANO_POW_PROFILE or ~/.nano_pow_profiles", cxxopts::value<std::string>())
+		("no_profile", "Do not apply tuning profiles")
+		("v,verbose", "Display more messages")
+		("h,help", "Print this message");
+	// clang-format on
+	int result (1);
+	try
+	{
+		auto parsed = options.parse (argc, argv);
+		if (parsed.count ("help"))
+		{
+			std::cout << options.help () << std::endl;
+			return 0;
+		}
+		std::unique_ptr<nano_pow::driver> driver{ nullptr };
+		auto driver_type (parsed["driver"].as<std::string> ());
+		if (driver_type == "cpp")
+		{
+			driver = std::make_unique<nano_pow::cpp_driver> ();
+		}
+		else if (driver_type == "opencl")
+		{
+			unsigned short platform (parsed.count ("platform") ? parsed["platform"].as<unsigned short> () : 0);
+			unsigned short device (parsed.count ("device") ? parsed["device"].as<unsigned short> () : 0);
+			driver = std::make_unique<nano_pow::opencl_driver> (platform, device);
+		}
+		else
+		{
+			std::cerr << "Invalid driver. Available: {cpp, opencl}" << std::endl;
+			return -1;
+		}
+		driver->verbose_set (parsed.count ("verbose") == 1);
+		if (parsed.count ("threads"))
+		{
+			// Profiles would replace the threads at the next difficulty band
+			driver->threads_set (parsed["threads"].as<unsigned> ());
+		}
+		else if (parsed.count ("no_profile") == 0)
+		{
+			driver->profile_load (parsed.count ("profile") ? parsed["profile"].as<std::string> () : nano_pow::profile_default_path ());
+		}
+		if (parsed.count ("lookup"))
+		{
+			auto lookup (parsed["lookup"].as<unsigned> ());
+			if (lookup < 1 || lookup > (driver->type () == nano_pow::driver_type::CPP ? nano_pow::cpp_driver::max_lookup : 32) || driver->memory_set (nano_pow::entries_to_memory (nano_pow::lookup_to_entries (lookup))))
+			{
+				std::cerr << "Incorrect lookup" << std::endl;
+				return -1;
+			}
+		}
+		else if (driver->type () == nano_pow::driver_type::OPENCL)
+		{
+			// Only the cpp driver sizes its table for each request
+			auto opencl (static_cast<nano_pow::opencl_driver *> (driver.get ()));
+			if (opencl->memory_set (opencl->max_memory ()))
+			{
+				return -1;
+			}
+		}
+		nano_pow::work_queue queue (*driver);
+		nano_pow::work_cache cache (queue, parsed["cache"].as<size_t> ());
+		nano_pow::server server (cache);
+		auto error (parsed.count ("unix") ? server.listen_unix (parsed["unix"].as<std::string> ()) : server.listen_tcp (parsed["port"].as<uint16_t> ()));
+		if (error)
+		{
+			std::cerr << "Unable to listen" << std::endl;
+		}
+		else
+		{
+			std::signal (SIGINT, interrupt);
+			std::signal (SIGTERM, interrupt);
+			server.start ();
+			if (parsed.count ("unix"))
+			{
+				std::cout << "Listening on " << parsed["unix"].as<std::string> () << std::endl;
+			}
+			else
+			{
+				std::cout << "Listening on 127.0.0.1:" << server.port_get () << std::endl;
+			}
+			while (!interrupted)
+			{
+				std::this_thread::sleep_for (std::chrono::milliseconds (100));
+			}
+			std::cout << "Stopping" << std::endl;
+			server.stop ();
+			queue.stop ();
+			result = 0;
+		}
+	}
+	catch (cxxopts::OptionException const & err)
+	{
+		std::cerr << err.what () << "\n\n"
+		          << options.help () << std::endl;
+	}
+	catch (nano_pow::OCLDriverException const & err)
+	{
+		std::cerr << "OpenCL error" << std::endl;
+		err.print (std::cerr);
+	}
+	return result;
+}
@@ -1,9 +1,150 @@
+#include <nano_pow/conversions.hpp>
 #include <nano_pow/cpp_driver.hpp>
+#include <nano_pow/cpu.hpp>
 #include <nano_pow/opencl_driver.hpp>
 #include <nano_pow/pow.hpp>
+#include <nano_pow/tuning.hpp>
+#include <nano_pow/work_cache.hpp>
+#include <nano_pow/work_queue.hpp>
 
 #include <gtest/gtest.h>
 
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <stdexcept>
+
+namespace
+{
+// Heap allocations made while `counting` is set
+std::atomic<bool> counting{ false };
+std::atomic<uint64_t> allocations{ 0 };
+}
+
+void * operator new (size_t size_a)
+{
+	if (counting)
+	{
+		++allocations;
+	}
+	auto result (std::malloc (size_a != 0 ? size_a : 1));
+	if (result == nullptr)
+	{
+		throw std::bad_alloc ();
+	}
+	return result;
+}
+
+void * operator new[] (size_t size_a)
+{
+	return ::operator new (size_a);
+}
+
+// GCC inlines the deallocation into new expressions but never the replaced operator new, and takes the pair for mismatched
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete (void * pointer_a) noexcept
+{
+	std::free (pointer_a);
+}
+
+void operator delete (void * pointer_a, size_t) noexcept
+{
+	std::free (pointer_a);
+}
+
+void operator delete[] (void * pointer_a) noexcept
+{
+	std::free (pointer_a);
+}
+
+void operator delete[] (void * pointer_a, size_t) noexcept
+{
+	std::free (pointer_a);
+}
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+#ifndef _WIN32
+#include <nano_pow/server.hpp>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace
+{
+class client
+{
+public:
+	client (uint16_t port_a)
+	{
+		socket = ::socket (AF_INET, SOCK_STREAM, 0);
+		sockaddr_in address{};
+		address.sin_family = AF_INET;
+		address.sin_port = htons (port_a);
+		address.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+		connected = ::connect (socket, reinterpret_cast<sockaddr *> (&address), sizeof (address)) == 0;
+	}
+	client (std::string const & path_a)
+	{
+		socket = ::socket (AF_UNIX, SOCK_STREAM, 0);
+		sockaddr_un address{};
+		address.sun_family = AF_UNIX;
+		path_a.copy (address.sun_path, sizeof (address.sun_path) - 1);
+		connected = ::connect (socket, reinterpret_cast<sockaddr *> (&address), sizeof (address)) == 0;
+	}
+	~client ()
+	{
+		::close (socket);
+	}
+	void send (std::string const & line_a)
+	{
+		auto data (line_a + '\n');
+		ASSERT_EQ (static_cast<ssize_t> (data.size ()), ::send (socket, data.data (), data.size (), 0));
+	}
+	std::string receive ()
+	{
+		while (buffer.find ('\n') == std::string::npos)
+		{
+			char chunk[256];
+			auto received (::recv (socket, chunk, sizeof (chunk), 0));
+			if (received <= 0)
+			{
+				return "";
+			}
+			buffer.append (chunk, static_cast<size_t> (received));
+		}
+		auto line (buffer.substr (0, buffer.find ('\n')));
+		buffer.erase (0, line.size () + 1);
+		return line;
+	}
+	int socket;
+	bool connected;
+	std::string buffer;
+};
+// Value of a string field in a flat JSON response
+std::string field (std::string const & response_a, std::string const & key_a)
+{
+	auto begin (response_a.find ("\"" + key_a + "\":\""));
+	if (begin == std::string::npos)
+	{
+		return "";
+	}
+	begin += key_a.size () + 4;
+	return response_a.substr (begin, response_a.find ('"', begin) - begin);
+}
+}
+#endif
+
 TEST (nano_pow, difficulty_64)
 {
 	ASSERT_EQ (nano_pow::reverse ((static_cast<nano_pow::uint128_t> (0x1ULL) << (4 + 32)) - 1), nano_pow::bit_difficulty_64 (4));
@@ -23,6 +164,7 @@ TEST (cpp_driver, solve)
 	ASSERT_FALSE (driver.memory_set (1ULL << 16));
 	driver.difficulty_set (nano_pow::bit_difficulty (32));
 	auto result (driver.solve (nonce));
+	ASSERT_LT (0U, driver.searched_get ());
 	auto difficulty (nano_pow::difficulty (nonce, result));
 	ASSERT_NE (static_cast<nano_pow::uint128_t> (0), difficulty);
 	auto passing_difficulty (nano_pow::bit_difficulty (32));
@@ -33,6 +175,597 @@ TEST (cpp_driver, solve)
 	ASSERT_FALSE (nano_pow::passes (nonce, result, failing_difficulty));
 }
 
+TEST (cpp_driver, memory_auto)
+{
+	nano_pow::cpp_driver driver;
+	ASSERT_TRUE (driver.memory_auto_get ());
+	std::array<uint64_t, 2> nonce{ 1, 0 };
+	size_t allocated{ 0 };
+	for (auto bits : { 24U, 16U, 24U })
+	{
+		driver.difficulty_set (nano_pow::bit_difficulty (bits));
+		auto memory (driver.memory_auto_size (driver.difficulty_get ()));
+		auto result (driver.solve (nonce));
+		ASSERT_EQ (memory, driver.memory_get ());
+		ASSERT_TRUE (nano_pow::passes (nonce, result, nano_pow::bit_difficulty (bits)));
+		// Smaller tables reuse a prefix of the first allocation
+		allocated = std::max (allocated, memory);
+		ASSERT_EQ (allocated, driver.memory_allocated_get ());
+	}
+	ASSERT_LT (driver.memory_auto_size (nano_pow::bit_difficulty (16)), driver.memory_auto_size (nano_pow::bit_difficulty (24)));
+	ASSERT_FALSE (driver.memory_set (1ULL << 16));
+	ASSERT_FALSE (driver.memory_auto_get ());
+}
+
+#ifdef __linux__
+TEST (cpp_driver, memory_auto_failure)
+{
+	nano_pow::cpp_driver driver;
+	std::array<uint64_t, 2> nonce{ 1, 0 };
+	driver.difficulty_set (nano_pow::bit_difficulty (16));
+	rlimit previous;
+	ASSERT_EQ (0, getrlimit (RLIMIT_AS, &previous));
+	// No address space is left for even the smallest table
+	size_t pages{ 0 };
+	std::ifstream ("/proc/self/statm") >> pages;
+	ASSERT_NE (0U, pages);
+	auto limit (previous);
+	limit.rlim_cur = pages * static_cast<size_t> (sysconf (_SC_PAGE_SIZE));
+	ASSERT_EQ (0, setrlimit (RLIMIT_AS, &limit));
+	bool thrown{ false };
+	try
+	{
+		driver.solve (nonce);
+	}
+	catch (std::runtime_error const &)
+	{
+		thrown = true;
+	}
+	ASSERT_EQ (0, setrlimit (RLIMIT_AS, &previous));
+	ASSERT_TRUE (thrown);
+}
+#endif
+
+TEST (cpp_driver, solve_allocations)
+{
+	nano_pow::cpp_driver driver;
+	ASSERT_FALSE (driver.memory_set (1ULL << 16));
+	driver.difficulty_set (nano_pow::bit_difficulty (24));
+	std::array<uint64_t, 2> nonce{ 0, 0 };
+	driver.solve (nonce);
+	allocations = 0;
+	counting = true;
+	for (uint64_t i (1); i < 5; ++i)
+	{
+		nonce[0] = i;
+		ASSERT_TRUE (nano_pow::passes (nonce, driver.solve (nonce), nano_pow::bit_difficulty (24)));
+	}
+	counting = false;
+	ASSERT_EQ (0U, allocations);
+}
+
+TEST (cpp_driver, search_kernels)
+{
+	nano_pow::cpp_driver driver;
+	ASSERT_FALSE (driver.memory_set (1ULL << 16));
+	ASSERT_EQ (nano_pow::search_kernel::AUTOMATIC, driver.search_kernel_get ());
+	// Difficulties other than a run of leading ones are checked quickly on their leading ones only, the rest would need far more zero bits
+	auto non_prefix (nano_pow::bit_difficulty (16) | (static_cast<nano_pow::uint128_t> (0x5555555555555555ULL) << 48));
+	for (auto difficulty : { nano_pow::bit_difficulty (24), nano_pow::bit_difficulty (20) | 1, non_prefix })
+	{
+		driver.difficulty_set (difficulty);
+		for (auto kernel : { nano_pow::search_kernel::AUTOMATIC, nano_pow::search_kernel::WORD_64, nano_pow::search_kernel::WORD_128 })
+		{
+			driver.search_kernel_set (kernel);
+			std::array<uint64_t, 2> nonce{ static_cast<uint64_t> (difficulty), static_cast<uint64_t> (kernel) };
+			ASSERT_TRUE (nano_pow::passes (nonce, driver.solve (nonce), difficulty));
+		}
+	}
+}
+
+TEST (cpp_driver, memory_max)
+{
+	nano_pow::cpp_driver driver;
+	size_t available{ 0 };
+	size_t max_memory{ 0 };
+	if (nano_pow::memory_available (available))
+	{
+		ASSERT_TRUE (driver.memory_max (max_memory));
+	}
+	else
+	{
+		ASSERT_FALSE (driver.memory_max (max_memory));
+		ASSERT_LE (max_memory, available);
+		ASSERT_EQ (0U, max_memory % (1 << 20));
+		// Automatic sizing never goes above it, short of its minimum table
+		ASSERT_LE (driver.memory_auto_size (nano_pow::bit_difficulty (127)), std::max (max_memory, nano_pow::entries_to_memory (nano_pow::lookup_to_entries (10))));
+	}
+}
+
+TEST (cpp_driver, prefault)
+{
+	nano_pow::cpp_driver driver;
+	ASSERT_TRUE (driver.prefault_get ());
+	ASSERT_FALSE (driver.memory_set (1ULL << 22));
+	auto duration (driver.prefault_duration_get ());
+	ASSERT_LT (0, duration.count ());
+	driver.prefault_set (false);
+	ASSERT_FALSE (driver.memory_set (1ULL << 21));
+	ASSERT_EQ (duration, driver.prefault_duration_get ());
+	driver.difficulty_set (nano_pow::bit_difficulty (20));
+	std::array<uint64_t, 2> nonce{ 3, 0 };
+	ASSERT_TRUE (nano_pow::passes (nonce, driver.solve (nonce), nano_pow::bit_difficulty (20)));
+}
+
+TEST (cpp_driver, memory_arena)
+{
+	nano_pow::cpp_driver driver;
+	ASSERT_FALSE (driver.memory_set (1ULL << 22));
+	auto duration (driver.prefault_duration_get ());
+	// Smaller tables are served from the allocation without prefaulting again
+	ASSERT_FALSE (driver.memory_set (1ULL << 20));
+	ASSERT_EQ (1ULL << 20, driver.memory_get ());
+	ASSERT_EQ (1ULL << 22, driver.memory_allocated_get ());
+	ASSERT_EQ (duration, driver.prefault_duration_get ());
+	driver.difficulty_set (nano_pow::bit_difficulty (20));
+	std::array<uint64_t, 2> nonce{ 4, 0 };
+	ASSERT_TRUE (nano_pow::passes (nonce, driver.solve (nonce), nano_pow::bit_difficulty (20)));
+	// Growing back after a trim faults the released pages in again
+	driver.memory_trim ();
+	ASSERT_FALSE (driver.memory_set (1ULL << 22));
+	ASSERT_EQ (1ULL << 22, driver.memory_allocated_get ());
+	ASSERT_NE (duration, driver.prefault_duration_get ());
+	ASSERT_TRUE (nano_pow::passes (nonce, driver.solve (nonce), nano_pow::bit_difficulty (20)));
+	// Larger tables are mapped anew
+	ASSERT_FALSE (driver.memory_set (1ULL << 23));
+	ASSERT_EQ (1ULL << 23, driver.memory_allocated_get ());
+}
+
+TEST (cpp_driver, overlap)
+{
+	nano_pow::cpp_driver driver;
+	ASSERT_EQ (0, driver.overlap_get ());
+	driver.overlap_set (2);
+	ASSERT_EQ (1, driver.overlap_get ());
+	driver.overlap_set (0.25);
+	driver.threads_set (2);
+	ASSERT_FALSE (driver.memory_set (nano_pow::entries_to_memory (nano_pow::lookup_to_entries (20))));
+	for (auto difficulty : { 16U, 20U, 24U })
+	{
+		driver.difficulty_set (nano_pow::bit_difficulty (difficulty));
+		std::array<uint64_t, 2> nonce{ difficulty, 7 };
+		ASSERT_TRUE (nano_pow::passes (nonce, driver.solve (nonce), nano_pow::bit_difficulty (difficulty)));
+		ASSERT_LE (driver.progress_get ().filled, driver.progress_get ().entries);
+		ASSERT_LT (0U, driver.searched_get ());
+	}
+	// Phases split across the pool still fill in turns
+	driver.difficulty_set (nano_pow::bit_difficulty (20));
+	for (auto fill_threads : { 1U, 2U })
+	{
+		driver.fill_threads_set (fill_threads);
+		driver.search_threads_set (3 - fill_threads);
+		std::array<uint64_t, 2> nonce{ fill_threads, 8 };
+		ASSERT_TRUE (nano_pow::passes (nonce, driver.solve (nonce), nano_pow::bit_difficulty (20)));
+	}
+}
+
+TEST (cpp_driver, phase_threads)
+{
+	nano_pow::cpp_driver driver;
+	driver.threads_set (3);
+	driver.fill_threads_set (1);
+	driver.search_threads_set (2);
+	ASSERT_EQ (1U, driver.fill_threads_get ());
+	ASSERT_EQ (2U, driver.search_threads_get ());
+	ASSERT_FALSE (driver.memory_set (nano_pow::entries_to_memory (nano_pow::lookup_to_entries (16))));
+	driver.difficulty_set (nano_pow::bit_difficulty (20));
+	std::array<uint64_t, 2> nonce{ 8, 0 };
+	ASSERT_TRUE (nano_pow::passes (nonce, driver.solve (nonce), nano_pow::bit_difficulty (20)));
+	// Each partition is filled even with fewer fill threads than partitions
+	std::vector<std::array<uint64_t, 2>> nonces{ { 1, 8 }, { 2, 8 }, { 3, 8 } };
+	auto results (driver.solve_batch (nonces));
+	for (size_t i (0); i < nonces.size (); ++i)
+	{
+		ASSERT_TRUE (nano_pow::passes (nonces[i], results[i], nano_pow::bit_difficulty (20)));
+	}
+	// Pinned fill, unpinned search
+	driver.fill_affinity_set ({ 0 });
+	ASSERT_EQ (1U, driver.fill_affinity_get ().size ());
+	ASSERT_TRUE (driver.search_affinity_get ().empty ());
+	nonce[1] = 1;
+	ASSERT_TRUE (nano_pow::passes (nonce, driver.solve (nonce), nano_pow::bit_difficulty (20)));
+}
+
+TEST (cpp_driver, default_threads)
+{
+	unsigned available{ 0 };
+	if (!nano_pow::cpu_available (available))
+	{
+		ASSERT_LT (0U, available);
+		ASSERT_LE (available, std::max (1U, std::thread::hardware_concurrency ()));
+		nano_pow::cpp_driver driver;
+		ASSERT_EQ (available, driver.threads_get ());
+	}
+	nano_pow::cpu_throttling throttling;
+	if (!nano_pow::cpu_throttling_get (throttling))
+	{
+		ASSERT_LE (throttling.throttled, throttling.periods);
+	}
+}
+
+TEST (cpp_driver, memory_not_power_of_2)
+{
+	nano_pow::cpp_driver driver;
+	driver.threads_set (2);
+	ASSERT_FALSE (driver.memory_set (3ULL << 20));
+	ASSERT_EQ (3ULL << 20, driver.memory_get ());
+	driver.difficulty_set (nano_pow::bit_difficulty (20));
+	for (uint64_t i (1); i <= 3; ++i)
+	{
+		std::array<uint64_t, 2> nonce{ i, 5 };
+		ASSERT_TRUE (nano_pow::passes (nonce, driver.solve (nonce), nano_pow::bit_difficulty (20)));
+	}
+	// Served from the arena at an arbitrary prefix
+	ASSERT_FALSE (driver.memory_set (5ULL << 18));
+	std::array<uint64_t, 2> nonce{ 6, 5 };
+	ASSERT_TRUE (nano_pow::passes (nonce, driver.solve (nonce), nano_pow::bit_difficulty (20)));
+}
+
+TEST (cpp_driver, solve_batch)
+{
+	nano_pow::cpp_driver driver;
+	driver.threads_set (4);
+	driver.difficulty_set (nano_pow::bit_difficulty (16));
+	std::vector<std::array<uint64_t, 2>> nonces;
+	for (uint64_t i (1); i <= 10; ++i)
+	{
+		nonces.push_back ({ i, i });
+	}
+	auto results (driver.solve_batch (nonces));
+	ASSERT_EQ (nonces.size (), results.size ());
+	for (size_t i (0); i < nonces.size (); ++i)
+	{
+		ASSERT_TRUE (nano_pow::passes (nonces[i], results[i], nano_pow::bit_difficulty (16)));
+	}
+	// Explicit memory is split in equal partitions
+	ASSERT_FALSE (driver.memory_set (nano_pow::entries_to_memory (nano_pow::lookup_to_entries (14))));
+	results = driver.solve_batch (nonces, 3);
+	for (size_t i (0); i < nonces.size (); ++i)
+	{
+		ASSERT_TRUE (nano_pow::passes (nonces[i], results[i], nano_pow::bit_difficulty (16)));
+	}
+	// Partitions hold one nonce each, there is no single fill to resume
+	ASSERT_EQ (2U, driver.solve_batch ({ { 13, 13 }, { 14, 14 } }).size ());
+	ASSERT_EQ (0U, driver.progress_get ().entries);
+	// A batch of one leaves its fill, which progress taken before the batch does not describe
+	driver.solve ({ 11, 11 });
+	auto progress (driver.progress_get ());
+	ASSERT_EQ (1U, driver.solve_batch ({ { 12, 12 } }).size ());
+	auto batch_progress (driver.progress_get ());
+	ASSERT_NE (progress.table, batch_progress.table);
+	ASSERT_EQ (12U, batch_progress.nonce[0]);
+	ASSERT_EQ (12U, driver.nonce[0]);
+}
+
+TEST (cpp_driver, tune)
+{
+	nano_pow::cpp_driver driver;
+	driver.difficulty_set (nano_pow::bit_difficulty (20));
+	nano_pow::tune_space space;
+	space.memory = { 1ULL << 16, 1ULL << 17 };
+	space.threads = { 1, 2 };
+	space.stepping = { 1024 };
+	space.prefetch = { 1, 8 };
+	space.joint = true;
+	std::vector<nano_pow::tune_result> ranked;
+	std::ostringstream stream;
+	ASSERT_FALSE (nano_pow::tune (driver, 2, space, ranked, stream));
+	ASSERT_EQ (8U, ranked.size ());
+	ASSERT_FALSE (ranked.front ().eliminated);
+	ASSERT_GE (ranked.front ().samples.size (), space.min_repeats);
+	ASSERT_EQ (ranked.front ().threads, driver.threads_get ());
+	ASSERT_EQ (ranked.front ().prefetch, driver.prefetch_get ());
+	for (auto i (ranked.begin () + 1), n (ranked.end ()); i != n && !i->eliminated; ++i)
+	{
+		ASSERT_LE ((i - 1)->mean (), i->mean ());
+	}
+	std::array<uint64_t, 2> nonce{ 1, 0 };
+	auto result (driver.solve (nonce));
+	ASSERT_TRUE (nano_pow::passes (nonce, result, nano_pow::bit_difficulty (20)));
+}
+
+TEST (cpp_driver, tune_axes)
+{
+	nano_pow::cpp_driver driver;
+	driver.difficulty_set (nano_pow::bit_difficulty (20));
+	nano_pow::tune_space space;
+	space.memory = { 1ULL << 16, 1ULL << 17 };
+	space.threads = { 1, 2 };
+	space.stepping = { 1024 };
+	space.prefetch = { 1, 8 };
+	std::vector<nano_pow::tune_result> ranked;
+	std::ostringstream stream;
+	ASSERT_FALSE (nano_pow::tune (driver, 2, space, ranked, stream));
+	// Both memories, the other thread count and the other prefetch, the best of each axis being measured again by the next
+	ASSERT_EQ (4U, ranked.size ());
+	ASSERT_EQ (ranked.front ().threads, driver.threads_get ());
+	ASSERT_EQ (ranked.front ().prefetch, driver.prefetch_get ());
+	std::array<uint64_t, 2> nonce{ 1, 0 };
+	auto result (driver.solve (nonce));
+	ASSERT_TRUE (nano_pow::passes (nonce, result, nano_pow::bit_difficulty (20)));
+}
+
+TEST (cpp_driver, profile)
+{
+	std::string path ("nano_pow_test_profiles");
+	nano_pow::cpp_driver driver;
+	nano_pow::profiles profiles;
+	nano_pow::profile profile_l;
+	profile_l.key = driver.profile_key_get ();
+	profile_l.key.band = nano_pow::profile_band (nano_pow::bit_difficulty (21));
+	profile_l.memory = nano_pow::entries_to_memory (nano_pow::lookup_to_entries (12));
+	profile_l.threads = 2;
+	profile_l.stepping = 512;
+	profiles.put (profile_l);
+	ASSERT_FALSE (profiles.save (path));
+	ASSERT_FALSE (driver.profile_load (path));
+	// Band 2 has no profile
+	driver.difficulty_set (nano_pow::bit_difficulty (8));
+	ASSERT_EQ (0U, driver.memory_get ());
+	driver.difficulty_set (nano_pow::bit_difficulty (20));
+	ASSERT_EQ (2U, driver.threads_get ());
+	ASSERT_EQ (512U, driver.stepping_get ());
+	// Automatic sizing is left to pick the memory
+	ASSERT_TRUE (driver.memory_auto_get ());
+	ASSERT_EQ (0U, driver.memory_get ());
+	driver.memory_auto_set (false);
+	ASSERT_FALSE (driver.profile_load (path));
+	std::remove (path.c_str ());
+	driver.difficulty_set (nano_pow::bit_difficulty (20));
+	ASSERT_EQ (profile_l.memory, driver.memory_get ());
+	std::array<uint64_t, 2> nonce{ 1, 0 };
+	auto result (driver.solve (nonce));
+	ASSERT_TRUE (nano_pow::passes (nonce, result, nano_pow::bit_difficulty (20)));
+}
+
+TEST (cpp_driver, resume)
+{
+	nano_pow::cpp_driver driver;
+	// A table holding another nonce's entries only solves by chance, out of reach at this difficulty
+	auto difficulty (nano_pow::bit_difficulty (40));
+	driver.difficulty_set (difficulty);
+	ASSERT_FALSE (driver.memory_set (nano_pow::entries_to_memory (nano_pow::lookup_to_entries (20))));
+	std::array<uint64_t, 2> nonce{ 1, 0 };
+	ASSERT_TRUE (nano_pow::passes (nonce, driver.solve (nonce), difficulty));
+	auto progress (driver.progress_get ());
+	ASSERT_NE (0U, progress.filled);
+	ASSERT_EQ (nano_pow::lookup_to_entries (20), progress.entries);
+	// The table still holds the fill
+	ASSERT_TRUE (nano_pow::passes (nonce, driver.resume (nonce, progress), difficulty));
+	// Resumes on the junk left by another nonce would search until cancelled
+	auto resume_guarded = [&driver, &difficulty](std::array<uint64_t, 2> nonce_a, nano_pow::solve_progress const & progress_a) {
+		auto resumed (std::async (std::launch::async, [&driver, nonce_a, &progress_a]() { return driver.resume (nonce_a, progress_a); }));
+		auto ready (resumed.wait_for (std::chrono::seconds (30)) == std::future_status::ready);
+		if (!ready)
+		{
+			driver.cancel_current ();
+		}
+		return ready && nano_pow::passes (nonce_a, resumed.get (), difficulty);
+	};
+	// Another solve filled the table in between, so the fill has to be redone
+	driver.solve ({ 2, 0 });
+	ASSERT_TRUE (resume_guarded (nonce, progress));
+	// Progress recorded for another nonce is not used either
+	progress = driver.progress_get ();
+	ASSERT_TRUE (resume_guarded ({ 3, 0 }, progress));
+}
+
+TEST (cpp_driver, cancel_solve)
+{
+	nano_pow::cpp_driver driver;
+	ASSERT_FALSE (driver.memory_set (nano_pow::entries_to_memory (nano_pow::lookup_to_entries (16))));
+	// Cancelled before it starts, the solve does not clear the cancel
+	driver.difficulty_set (nano_pow::bit_difficulty (60));
+	driver.cancel_solve (driver.solve_token ());
+	ASSERT_EQ (0U, driver.solve ({ 1, 0 })[1]);
+	// The token only names that solve
+	driver.difficulty_set (nano_pow::bit_difficulty (16));
+	std::array<uint64_t, 2> nonce{ 2, 0 };
+	ASSERT_TRUE (nano_pow::passes (nonce, driver.solve (nonce), nano_pow::bit_difficulty (16)));
+}
+
+TEST (work_queue, priority)
+{
+	nano_pow::cpp_driver driver;
+	driver.threads_set (2);
+	ASSERT_FALSE (driver.memory_set (nano_pow::entries_to_memory (nano_pow::lookup_to_entries (18))));
+	nano_pow::work_queue queue (driver);
+	std::array<uint64_t, 2> large{ 1, 0 };
+	std::array<uint64_t, 2> urgent{ 2, 0 };
+	auto large_result (queue.push (large, nano_pow::bit_difficulty (60)));
+	std::this_thread::sleep_for (std::chrono::milliseconds (50));
+	auto urgent_result (queue.push (urgent, nano_pow::bit_difficulty (16), 1));
+	ASSERT_TRUE (nano_pow::passes (urgent, urgent_result.get (), nano_pow::bit_difficulty (16)));
+	ASSERT_TRUE (queue.cancel (large));
+	auto cancelled (large_result.get ());
+	ASSERT_EQ (0U, cancelled[1]);
+	auto expired (queue.push ({ 3, 0 }, nano_pow::bit_difficulty (60), 0, nano_pow::work_queue::clock::now () + std::chrono::milliseconds (20)));
+	ASSERT_EQ (0U, expired.get ()[1]);
+	auto stats (queue.stats_get ());
+	ASSERT_EQ (1U, stats[1].solved);
+	ASSERT_EQ (1U, stats[0].preempted);
+	ASSERT_EQ (1U, stats[0].cancelled);
+	ASSERT_EQ (1U, stats[0].expired);
+	ASSERT_EQ (0U, queue.size ());
+}
+
+TEST (work_cache, precompute)
+{
+	nano_pow::cpp_driver driver;
+	driver.threads_set (2);
+	ASSERT_FALSE (driver.memory_set (nano_pow::entries_to_memory (nano_pow::lookup_to_entries (18))));
+	nano_pow::work_queue queue (driver);
+	nano_pow::work_cache cache (queue, 2);
+	std::array<uint64_t, 2> frontier{ 1, 1 };
+	cache.precompute (frontier, nano_pow::bit_difficulty (20));
+	cache.precompute (frontier, nano_pow::bit_difficulty (16));
+	std::array<uint64_t, 2> work{ { 0, 0 } };
+	for (auto i (0); i < 1000 && !cache.find (frontier, nano_pow::bit_difficulty (20), work); ++i)
+	{
+		std::this_thread::sleep_for (std::chrono::milliseconds (10));
+	}
+	ASSERT_TRUE (nano_pow::passes (frontier, work, nano_pow::bit_difficulty (20)));
+	// Answered from the cache, a higher difficulty is solved again
+	auto hit (cache.solve (frontier, nano_pow::bit_difficulty (16)));
+	ASSERT_EQ (std::future_status::ready, hit.wait_for (std::chrono::seconds (0)));
+	ASSERT_EQ (work, hit.get ());
+	auto higher (nano_pow::bit_difficulty (nano_pow::difficulty_bits (nano_pow::difficulty (frontier, work)) + 1));
+	ASSERT_TRUE (nano_pow::passes (frontier, cache.solve (frontier, higher).get (), higher));
+	// The least recently used entry is dropped
+	ASSERT_TRUE (nano_pow::passes ({ 2, 1 }, cache.solve ({ 2, 1 }, nano_pow::bit_difficulty (16)).get (), nano_pow::bit_difficulty (16)));
+	ASSERT_TRUE (nano_pow::passes ({ 3, 1 }, cache.solve ({ 3, 1 }, nano_pow::bit_difficulty (16)).get (), nano_pow::bit_difficulty (16)));
+	for (auto i (0); i < 1000 && cache.stats_get ().evictions == 0; ++i)
+	{
+		std::this_thread::sleep_for (std::chrono::milliseconds (10));
+	}
+	ASSERT_FALSE (cache.find (frontier, nano_pow::bit_difficulty (16), work));
+	auto stats (cache.stats_get ());
+	ASSERT_EQ (1U, stats.precomputes);
+	ASSERT_EQ (1U, stats.duplicates);
+	ASSERT_EQ (1U, stats.hits);
+	ASSERT_EQ (3U, stats.misses);
+	ASSERT_EQ (1U, stats.evictions);
+	ASSERT_EQ (2U, cache.size ());
+}
+
+TEST (work_cache, promote)
+{
+	nano_pow::cpp_driver driver;
+	driver.threads_set (2);
+	ASSERT_FALSE (driver.memory_set (nano_pow::entries_to_memory (nano_pow::lookup_to_entries (18))));
+	nano_pow::work_queue queue (driver);
+	nano_pow::work_cache cache (queue);
+	std::array<uint64_t, 2> frontier{ 4, 1 };
+	cache.precompute (frontier, nano_pow::bit_difficulty (24));
+	// The request joins the hint instead of cancelling it and solving again
+	ASSERT_TRUE (nano_pow::passes (frontier, cache.solve (frontier, nano_pow::bit_difficulty (20), 1).get (), nano_pow::bit_difficulty (24)));
+	uint64_t solved{ 0 };
+	for (auto const & stats : queue.stats_get ())
+	{
+		ASSERT_EQ (0U, stats.second.cancelled);
+		solved += stats.second.solved;
+	}
+	ASSERT_EQ (1U, solved);
+	ASSERT_EQ (1U, cache.stats_get ().misses);
+	std::array<uint64_t, 2> work{ { 0, 0 } };
+	for (auto i (0); i < 1000 && !cache.find (frontier, nano_pow::bit_difficulty (24), work); ++i)
+	{
+		std::this_thread::sleep_for (std::chrono::milliseconds (10));
+	}
+	ASSERT_TRUE (nano_pow::passes (frontier, work, nano_pow::bit_difficulty (24)));
+}
+
+#ifndef _WIN32
+TEST (server, tcp)
+{
+	nano_pow::cpp_driver driver;
+	nano_pow::work_queue queue (driver);
+	nano_pow::work_cache cache (queue);
+	nano_pow::server server (cache);
+	ASSERT_FALSE (server.listen_tcp (0));
+	server.start ();
+	client first (server.port_get ());
+	client second (server.port_get ());
+	ASSERT_TRUE (first.connected);
+	ASSERT_TRUE (second.connected);
+	auto nonce ("0000000000000001" + std::string ("0000000000000002"));
+	// 16 bits, 64 bit difficulties start at 32 bits
+	auto difficulty ("ffff000000000000" + std::string ("0000000000000000"));
+	first.send ("{\"action\":\"work_generate\",\"id\":1,\"nonce\":\"" + nonce + "\",\"difficulty\":\"" + difficulty + "\"}");
+	second.send ("{\"action\":\"work_generate\",\"id\":\"b\",\"nonce\":\"" + nonce + "\",\"difficulty\":\"" + difficulty + "\"}");
+	auto generated (first.receive ());
+	ASSERT_EQ (0U, generated.find ("{\"id\":1,\"action\":\"work_generate\",\"work\":\""));
+	auto work (field (generated, "work"));
+	ASSERT_EQ (32U, work.size ());
+	ASSERT_EQ (0U, second.receive ().find ("{\"id\":\"b\""));
+	first.send ("{\"action\":\"work_validate\",\"nonce\":\"" + nonce + "\",\"work\":\"" + work + "\",\"difficulty\":\"" + difficulty + "\"}");
+	ASSERT_NE (std::string::npos, first.receive ().find ("\"valid\":true"));
+	first.send ("{\"action\":\"work_validate\",\"nonce\":\"" + nonce + "\",\"work\":\"" + work + "\",\"difficulty\":\"ffffffffffffffff\"}");
+	ASSERT_NE (std::string::npos, first.receive ().find ("\"valid\":false"));
+	first.send ("{\"action\":\"work_cancel\",\"nonce\":\"" + nonce + "\"}");
+	ASSERT_NE (std::string::npos, first.receive ().find ("\"cancelled\":false"));
+	first.send ("not json");
+	ASSERT_EQ ("{\"error\":\"Malformed request\"}", first.receive ());
+	first.send ("{\"action\":\"work_generate\",\"nonce\":\"12\"}");
+	ASSERT_NE (std::string::npos, first.receive ().find ("Invalid nonce"));
+}
+
+TEST (server, unix_cancel)
+{
+	nano_pow::cpp_driver driver;
+	ASSERT_FALSE (driver.memory_set (nano_pow::entries_to_memory (nano_pow::lookup_to_entries (18))));
+	nano_pow::work_queue queue (driver);
+	nano_pow::work_cache cache (queue);
+	nano_pow::server server (cache);
+	std::string path ("nano_pow_test_server.sock");
+	ASSERT_FALSE (server.listen_unix (path));
+	server.start ();
+	client client_l (path);
+	ASSERT_TRUE (client_l.connected);
+	auto other (std::make_unique<client> (path));
+	ASSERT_TRUE (other->connected);
+	auto nonce ("0000000000000003" + std::string ("0000000000000004"));
+	// Unreachable in the test's time
+	auto generate ("\"action\":\"work_generate\",\"nonce\":\"" + nonce + "\",\"difficulty\":\"fffffffffffffff0\"}");
+	client_l.send ("{\"id\":7," + generate);
+	other->send ("{\"id\":8," + generate);
+	std::this_thread::sleep_for (std::chrono::milliseconds (20));
+	client_l.send ("{\"action\":\"work_cancel\",\"nonce\":\"" + nonce + "\"}");
+	auto first (client_l.receive ());
+	auto second (client_l.receive ());
+	ASSERT_NE (std::string::npos, (first + second).find ("\"cancelled\":true"));
+	ASSERT_NE (std::string::npos, (first + second).find ("{\"id\":7,\"action\":\"work_generate\",\"error\":\"Cancelled\"}"));
+	// The other connection still wants the solve, until it disconnects
+	ASSERT_EQ (1U, queue.size ());
+	other.reset ();
+	for (auto i (0); i < 1000 && queue.size () != 0; ++i)
+	{
+		std::this_thread::sleep_for (std::chrono::milliseconds (10));
+	}
+	ASSERT_EQ (0U, queue.size ());
+}
+
+TEST (server, limits)
+{
+	nano_pow::cpp_driver driver;
+	ASSERT_FALSE (driver.memory_set (nano_pow::entries_to_memory (nano_pow::lookup_to_entries (18))));
+	nano_pow::work_queue queue (driver);
+	nano_pow::work_cache cache (queue);
+	nano_pow::server server (cache);
+	ASSERT_FALSE (server.listen_tcp (0));
+	server.start ();
+	client client_l (server.port_get ());
+	ASSERT_TRUE (client_l.connected);
+	auto nonce ("0000000000000005" + std::string ("0000000000000006"));
+	auto generate ("\"action\":\"work_generate\",\"nonce\":\"" + nonce + "\",\"difficulty\":\"fffffffffffffff0\"");
+	// Priorities above the queue's range are refused rather than truncated
+	client_l.send ("{" + generate + ",\"priority\":4294967296}");
+	ASSERT_NE (std::string::npos, client_l.receive ().find ("Invalid priority or timeout"));
+	for (auto i (0); i < 256; ++i)
+	{
+		client_l.send ("{" + generate + "}");
+	}
+	client_l.send ("{\"id\":9," + generate + "}");
+	ASSERT_EQ ("{\"id\":9,\"action\":\"work_generate\",\"error\":\"Too many requests\"}", client_l.receive ());
+	client_l.send ("{\"action\":\"work_cancel\",\"nonce\":\"" + nonce + "\"}");
+	for (auto i (0); i < 256; ++i)
+	{
+		ASSERT_NE (std::string::npos, client_l.receive ().find ("\"error\":\"Cancelled\""));
+	}
+	ASSERT_NE (std::string::npos, client_l.receive ().find ("\"cancelled\":true"));
+}
+#endif
+
 TEST (opencl_driver, solve)
 {
 	bool opencl_available{ true };
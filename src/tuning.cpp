@@ -1,113 +1,345 @@
 #include <nano_pow/conversions.hpp>
 #include <nano_pow/tuning.hpp>
 
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <functional>
+#include <iomanip>
+#include <limits>
+#include <numeric>
 #include <sstream>
 
-size_t nano_pow::solve_many (nano_pow::driver & driver_a, size_t const count_a)
+namespace
+{
+// Two-sided 95% critical values of the Student t distribution, indexed by degrees of freedom - 1
+std::array<double, 30> const t_critical_values{ { 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042 } };
+
+double t_critical (size_t const degrees_a)
+{
+	assert (degrees_a > 0);
+	return degrees_a <= t_critical_values.size () ? t_critical_values[degrees_a - 1] : 1.960;
+}
+}
+
+size_t nano_pow::solve_many (nano_pow::driver & driver_a, size_t const count_a, uint64_t const first_nonce_a)
 {
 	auto start (std::chrono::steady_clock::now ());
-	for (unsigned i{ 0 }; i < count_a; ++i)
+	for (uint64_t i{ 0 }; i < count_a; ++i)
 	{
-		driver_a.solve ({ i + 1, 0 });
+		driver_a.solve ({ first_nonce_a + i, 0 });
 	}
 	auto duration = (std::chrono::steady_clock::now () - start).count ();
 	return duration;
 }
 
-bool nano_pow::tune (nano_pow::cpp_driver & driver_a, unsigned const count_a, size_t const initial_memory_a, size_t const initial_threads_a, size_t & best_memory_a)
+double nano_pow::tune_result::mean () const
 {
-	std::ostringstream oss;
-	return tune (driver_a, count_a, initial_memory_a, initial_threads_a, best_memory_a, oss);
+	if (samples.empty ())
+	{
+		return std::numeric_limits<double>::infinity ();
+	}
+	return std::accumulate (samples.begin (), samples.end (), 0.0) / samples.size ();
 }
 
-bool nano_pow::tune (nano_pow::opencl_driver & driver_a, unsigned const count_a, size_t const initial_memory_a, size_t const initial_threads_a, size_t & max_memory_a, size_t & best_memory_a, size_t & best_threads_a)
+double nano_pow::tune_result::interval () const
 {
-	std::ostringstream oss;
-	return tune (driver_a, count_a, initial_memory_a, initial_threads_a, max_memory_a, best_memory_a, best_threads_a, oss);
+	if (samples.size () < 2)
+	{
+		return std::numeric_limits<double>::infinity ();
+	}
+	auto mean_l (mean ());
+	double squares{ 0 };
+	for (auto sample : samples)
+	{
+		squares += (sample - mean_l) * (sample - mean_l);
+	}
+	auto variance (squares / (samples.size () - 1));
+	return t_critical (samples.size () - 1) * std::sqrt (variance / samples.size ());
 }
 
-bool nano_pow::tune (nano_pow::cpp_driver & driver_a, unsigned const count_a, size_t const initial_memory_a, size_t const initial_threads_a, size_t & best_memory_a, std::ostream & stream)
+nano_pow::tune_space nano_pow::tune_space_default (size_t const initial_memory_a, size_t const initial_threads_a)
 {
-	bool error{ false };
-
-	//clang-format off
-	auto try_memory_set = [&driver_a, &stream, &error](size_t const memory) {
-		if (driver_a.memory_set (memory))
+	size_t const min_memory = nano_pow::entries_to_memory (nano_pow::lookup_to_entries (18));
+	size_t const max_memory = nano_pow::entries_to_memory (nano_pow::lookup_to_entries (nano_pow::cpp_driver::max_lookup));
+	size_t const max_memory_32 = nano_pow::entries_to_memory (nano_pow::lookup_to_entries (32));
+	nano_pow::tune_space result;
+	for (auto threads (initial_threads_a); threads > 0 && result.threads.size () < 3; threads /= 2)
+	{
+		result.threads.push_back (threads);
+	}
+	// The fill may saturate memory bandwidth with half the threads
+	if (initial_threads_a > 1)
+	{
+		result.fill_threads.push_back (initial_threads_a / 2);
+	}
+	// Tables need not be a power of 2, so sizes halfway between the powers are explored too
+	for (auto memory : { initial_memory_a / 2, initial_memory_a / 4 * 3, initial_memory_a, initial_memory_a / 2 * 3, initial_memory_a * 2 })
+	{
+		if (memory >= min_memory && memory <= max_memory)
 		{
-			size_t available{ 0 };
-			auto checked (!nano_pow::memory_available (available));
-			stream << "Failed to allocate " << nano_pow::to_megabytes (memory) << "MB." << std::endl;
-			if (checked)
-			{
-				stream << "Only " << nano_pow ::to_megabytes (available) << "MB available" << std::endl;
-			}
-			error = true;
+			result.memory.push_back (memory);
 		}
-		else
+	}
+	// Starting near 2^32 entries, the larger tables are explored too, the tuner skips those above the memory available
+	for (auto memory (initial_memory_a * 2); initial_memory_a * 2 >= max_memory_32 && memory / 2 * 3 <= max_memory; memory *= 2)
+	{
+		result.memory.push_back (memory / 2 * 3);
+		if (memory * 2 <= max_memory)
 		{
-			error = false;
+			result.memory.push_back (memory * 2);
 		}
-		return error;
-	};
-	//clang-format on
+	}
+	result.stepping = { 1024, 4096 };
+	result.prefetch = { 1, 8 };
+	return result;
+}
 
-	size_t const min_memory = nano_pow::entries_to_memory (nano_pow::lookup_to_entries (18));
-	size_t const max_memory = nano_pow::entries_to_memory (nano_pow::lookup_to_entries (32));
-	size_t memory (initial_memory_a);
-	driver_a.threads_set (initial_threads_a);
+namespace
+{
+bool same_configuration (nano_pow::tune_result const & a, nano_pow::tune_result const & b)
+{
+	return a.memory == b.memory && a.threads == b.threads && a.fill_threads == b.fill_threads && a.stepping == b.stepping && a.prefetch == b.prefetch;
+}
 
-	/*
-	 * Find the best memory configuration for this difficulty
-	 * Start at the recommended difficulty/2 + 1 lookup size
-	 * Go down and then up in memory until a worse configuration is found in both directions
-	 */
-	while (try_memory_set (memory) && memory > min_memory)
+// Measures `candidates_a`, ordered by decreasing memory, dropping those slower than the best one with 95% confidence
+void race (nano_pow::cpp_driver & driver_a, unsigned const count_a, nano_pow::tune_space const & space_a, std::vector<nano_pow::tune_result> & candidates_a, std::ostream & stream)
+{
+	// Every repeat solves new problems, the same ones for all candidates
+	uint64_t nonce{ 1 };
+	for (unsigned repeat{ 0 }; repeat < space_a.max_repeats; ++repeat)
 	{
-		memory /= 2;
+		size_t memory{ 0 };
+		for (auto & candidate : candidates_a)
+		{
+			if (candidate.eliminated)
+			{
+				continue;
+			}
+			if (candidate.memory != memory)
+			{
+				if (driver_a.memory_set (candidate.memory))
+				{
+					stream << "Failed to allocate " << nano_pow::to_megabytes (candidate.memory) << "MB" << std::endl;
+					for (auto & other : candidates_a)
+					{
+						other.eliminated |= other.memory == candidate.memory;
+					}
+					continue;
+				}
+				memory = candidate.memory;
+			}
+			driver_a.threads_set (static_cast<unsigned> (candidate.threads));
+			driver_a.fill_threads_set (static_cast<unsigned> (candidate.fill_threads));
+			driver_a.stepping_set (candidate.stepping);
+			driver_a.prefetch_set (candidate.prefetch);
+			candidate.samples.push_back (static_cast<double> (nano_pow::solve_many (driver_a, count_a, nonce)) / count_a);
+			stream << candidate.threads << " threads " << (candidate.fill_threads == 0 ? candidate.threads : candidate.fill_threads) << " filling " << nano_pow::to_megabytes (candidate.memory) << "MB stepping " << candidate.stepping << " prefetch " << candidate.prefetch << " average " << candidate.samples.back () * 1e-6 << "ms" << std::endl;
+		}
+		nonce += count_a;
+		if (repeat + 1 >= space_a.min_repeats)
+		{
+			// Drop configurations that are slower than the best one with 95% confidence
+			auto best (std::min_element (candidates_a.begin (), candidates_a.end (), [](nano_pow::tune_result const & a, nano_pow::tune_result const & b) {
+				return !a.eliminated && (b.eliminated || a.mean () < b.mean ());
+			}));
+			size_t remaining{ 0 };
+			for (auto & candidate : candidates_a)
+			{
+				if (!candidate.eliminated && candidate.mean () - candidate.interval () > best->mean () + best->interval ())
+				{
+					candidate.eliminated = true;
+				}
+				remaining += !candidate.eliminated;
+			}
+			if (remaining <= 1)
+			{
+				break;
+			}
+		}
 	}
-	if (error)
+}
+}
+
+bool nano_pow::tune (nano_pow::cpp_driver & driver_a, unsigned const count_a, nano_pow::tune_space const & space_a, std::vector<nano_pow::tune_result> & ranked_a, std::ostream & stream)
+{
+	std::vector<nano_pow::tune_result> candidates;
+	size_t max_memory{ std::numeric_limits<size_t>::max () };
+	if (!driver_a.memory_max (max_memory))
 	{
-		stream << "Could not allocate the minimum amount of memory" << std::endl;
-		return error;
+		stream << "Largest safe memory " << nano_pow::to_megabytes (max_memory) << "MB" << std::endl;
 	}
-	size_t best_duration = std::chrono::system_clock::duration::max ().count ();
-	auto duration = best_duration;
-	// Go down in memory
-	while (!error && memory >= min_memory)
+	std::vector<size_t> memories;
+	auto skipped (false);
+	for (auto memory : space_a.memory)
 	{
-		duration = solve_many (driver_a, count_a);
-		stream << driver_a.threads_get () << " threads " << nano_pow::to_megabytes (memory) << "MB average " << duration * 1e-6 / count_a << "ms" << std::endl;
-		if (duration < best_duration)
+		if (memory > max_memory)
 		{
-			best_duration = duration;
-			best_memory_a = memory;
+			stream << "Skipping " << nano_pow::to_megabytes (memory) << "MB, more than available" << std::endl;
+			skipped = true;
 		}
 		else
 		{
-			break;
+			memories.push_back (memory);
+		}
+	}
+	if (skipped && max_memory > 0 && std::find (memories.begin (), memories.end (), max_memory) == memories.end ())
+	{
+		// Sizes were too large, the largest safe one is tried instead so all of the memory available is considered
+		memories.push_back (max_memory);
+	}
+	// Candidates are ordered by decreasing memory so each repeat maps the largest size once and serves the others from it
+	std::sort (memories.begin (), memories.end (), std::greater<size_t> ());
+	if (space_a.joint)
+	{
+		for (auto memory : memories)
+		{
+			for (auto threads : space_a.threads)
+			{
+				for (auto fill_threads : space_a.fill_threads)
+				{
+					// Fill threads are taken from the pool, so as many or more is the same as all of them
+					if (fill_threads >= threads)
+					{
+						continue;
+					}
+					for (auto stepping : space_a.stepping)
+					{
+						for (auto prefetch : space_a.prefetch)
+						{
+							nano_pow::tune_result candidate;
+							candidate.memory = memory;
+							candidate.threads = threads;
+							candidate.fill_threads = fill_threads;
+							candidate.stepping = stepping;
+							candidate.prefetch = prefetch;
+							candidates.push_back (candidate);
+						}
+					}
+				}
+			}
 		}
-		memory /= 2;
-		try_memory_set (memory);
+		stream << "Tuning " << candidates.size () << " configurations" << std::endl;
+		race (driver_a, count_a, space_a, candidates, stream);
 	}
-	// Go up in memory
-	memory = initial_memory_a * 2;
-	while (!error && memory <= max_memory && !try_memory_set (memory))
+	else if (!memories.empty () && !space_a.threads.empty () && !space_a.fill_threads.empty () && !space_a.stepping.empty () && !space_a.prefetch.empty ())
 	{
-		duration = solve_many (driver_a, count_a);
-		stream << driver_a.threads_get () << " threads " << nano_pow::to_megabytes (memory) << "MB average " << duration * 1e-6 / count_a << "ms" << std::endl;
-		if (duration < best_duration)
+		// One axis at a time, the others held at the best values found so far, starting from the first value of each
+		nano_pow::tune_result best;
+		best.memory = memories.front ();
+		best.threads = space_a.threads.front ();
+		best.fill_threads = space_a.fill_threads.front ();
+		best.stepping = space_a.stepping.front ();
+		best.prefetch = space_a.prefetch.front ();
+		auto axis ([&](char const * name_a, auto const & values_a, auto field_a) {
+			std::vector<nano_pow::tune_result> axis_l;
+			for (auto value : values_a)
+			{
+				nano_pow::tune_result candidate;
+				candidate.memory = best.memory;
+				candidate.threads = best.threads;
+				candidate.fill_threads = best.fill_threads;
+				candidate.stepping = best.stepping;
+				candidate.prefetch = best.prefetch;
+				candidate.*field_a = value;
+				// Fill threads are taken from the pool, so as many or more is the same as all of them
+				if (candidate.fill_threads < candidate.threads)
+				{
+					axis_l.push_back (candidate);
+				}
+			}
+			// Axes with a single value have nothing to compare
+			if (axis_l.size () > 1)
+			{
+				stream << "Tuning " << name_a << ", " << axis_l.size () << " configurations" << std::endl;
+				race (driver_a, count_a, space_a, axis_l, stream);
+				auto axis_best (std::min_element (axis_l.begin (), axis_l.end (), [](nano_pow::tune_result const & a, nano_pow::tune_result const & b) {
+					return a.mean () < b.mean ();
+				}));
+				if (!axis_best->samples.empty ())
+				{
+					best = *axis_best;
+				}
+				candidates.insert (candidates.end (), axis_l.begin (), axis_l.end ());
+			}
+		});
+		axis ("memory", memories, &nano_pow::tune_result::memory);
+		axis ("threads", space_a.threads, &nano_pow::tune_result::threads);
+		axis ("fill threads", space_a.fill_threads, &nano_pow::tune_result::fill_threads);
+		axis ("stepping", space_a.stepping, &nano_pow::tune_result::stepping);
+		axis ("prefetch", space_a.prefetch, &nano_pow::tune_result::prefetch);
+		if (candidates.empty ())
 		{
-			best_duration = duration;
-			best_memory_a = memory;
+			// Every axis has a single value, that configuration is still measured
+			candidates.push_back (best);
+			race (driver_a, count_a, space_a, candidates, stream);
 		}
-		else
+		// The best configuration of each axis is measured again by the next one, only its latest measurement is kept
+		for (auto i (candidates.begin ()); i != candidates.end ();)
 		{
-			break;
+			auto later (std::find_if (i + 1, candidates.end (), [&i](nano_pow::tune_result const & candidate) { return same_configuration (*i, candidate); }));
+			i = later != candidates.end () ? candidates.erase (i) : i + 1;
 		}
-		memory *= 2;
 	}
-	stream << "Found best memory " << nano_pow::to_megabytes (best_memory_a) << "MB" << std::endl;
-	return false;
+	// Configurations that could not be measured are not reported
+	candidates.erase (std::remove_if (candidates.begin (), candidates.end (), [](nano_pow::tune_result const & candidate) { return candidate.samples.empty (); }), candidates.end ());
+	std::stable_sort (candidates.begin (), candidates.end (), [](nano_pow::tune_result const & a, nano_pow::tune_result const & b) {
+		return a.eliminated != b.eliminated ? b.eliminated : a.mean () < b.mean ();
+	});
+	ranked_a = candidates;
+	bool error (ranked_a.empty ());
+	if (error)
+	{
+		stream << "Could not measure any configuration" << std::endl;
+	}
+	else
+	{
+		auto const & best (ranked_a.front ());
+		error = driver_a.memory_set (best.memory);
+		// Larger sizes measured on the same mapping are not needed any more
+		driver_a.memory_trim ();
+		driver_a.threads_set (static_cast<unsigned> (best.threads));
+		driver_a.fill_threads_set (static_cast<unsigned> (best.fill_threads));
+		driver_a.stepping_set (best.stepping);
+		driver_a.prefetch_set (best.prefetch);
+	}
+	return error;
+}
+
+void nano_pow::tune_report (std::vector<nano_pow::tune_result> const & ranked_a, std::ostream & stream)
+{
+	stream << std::left << std::setw (6) << "Rank" << std::setw (9) << "Threads" << std::setw (6) << "Fill" << std::setw (10) << "Memory" << std::setw (10) << "Stepping" << std::setw (10) << "Prefetch" << std::setw (24) << "Average (95% CI)" << "Repeats" << std::endl;
+	unsigned rank{ 0 };
+	for (auto const & result : ranked_a)
+	{
+		std::ostringstream average;
+		average << std::fixed << std::setprecision (1) << result.mean () * 1e-6 << " +- " << result.interval () * 1e-6 << "ms";
+		stream << std::left << std::setw (6) << ++rank << std::setw (9) << result.threads << std::setw (6) << (result.fill_threads == 0 ? result.threads : result.fill_threads) << std::setw (10) << (std::to_string (nano_pow::to_megabytes (result.memory)) + "MB") << std::setw (10) << result.stepping << std::setw (10) << result.prefetch << std::setw (24) << average.str () << result.samples.size () << (result.eliminated ? " (eliminated)" : "") << std::endl;
+	}
+}
+
+bool nano_pow::tune (nano_pow::cpp_driver & driver_a, unsigned const count_a, size_t const initial_memory_a, size_t const initial_threads_a, size_t & best_memory_a)
+{
+	std::ostringstream oss;
+	return tune (driver_a, count_a, initial_memory_a, initial_threads_a, best_memory_a, oss);
+}
+
+bool nano_pow::tune (nano_pow::opencl_driver & driver_a, unsigned const count_a, size_t const initial_memory_a, size_t const initial_threads_a, size_t & max_memory_a, size_t & best_memory_a, size_t & best_threads_a)
+{
+	std::ostringstream oss;
+	return tune (driver_a, count_a, initial_memory_a, initial_threads_a, max_memory_a, best_memory_a, best_threads_a, oss);
+}
+
+bool nano_pow::tune (nano_pow::cpp_driver & driver_a, unsigned const count_a, size_t const initial_memory_a, size_t const initial_threads_a, size_t & best_memory_a, std::ostream & stream)
+{
+	std::vector<nano_pow::tune_result> ranked;
+	auto error (tune (driver_a, count_a, tune_space_default (initial_memory_a, initial_threads_a), ranked, stream));
+	if (!error)
+	{
+		best_memory_a = ranked.front ().memory;
+		stream << "Found best memory " << nano_pow::to_megabytes (best_memory_a) << "MB" << std::endl;
+	}
+	return error;
 }
 
 bool nano_pow::tune (nano_pow::opencl_driver & driver_a, unsigned const count_a, size_t const initial_memory_a, size_t const initial_threads_a, size_t & max_memory_a, size_t & best_memory_a, size_t & best_threads_a, std::ostream & stream)
@@ -118,20 +350,26 @@ bool nano_pow::tune (nano_pow::opencl_driver & driver_a, unsigned const count_a,
 
 	bool error{ true };
 
-	size_t memory (initial_memory_a);
+	size_t memory (std::min (initial_memory_a, driver_a.max_memory ()));
 	size_t threads{ initial_threads_a };
+	// Tuning measures fixed configurations
+	driver_a.adaptive_set (false);
 	driver_a.threads_set (threads);
 
 	/*
 	 * Find the maximum memory available
-	 * Memory is allocated in up to 4 slabs due to contiguous memory allocation limits in some devices
+	 * Memory is split in as many slabs as needed due to contiguous memory allocation limits in some devices
 	 * This result can vary depending on current usage of the device
 	 */
 	while (error && memory > min_memory)
 	{
 		try
 		{
-			driver_a.memory_set (memory);
+			if (driver_a.memory_set (memory))
+			{
+				memory /= 2;
+				continue;
+			}
 			driver_a.fill ();
 			//TODO do all cases fail in fill? If not, uncomment next line or replace with solve()
 			// search ();
@@ -224,5 +462,38 @@ bool nano_pow::tune (nano_pow::opencl_driver & driver_a, unsigned const count_a,
 		driver_a.threads_set (best_threads_a);
 	}
 
+	/*
+	 * Compare the direct and the local memory staged fill kernels
+	 */
+	if (!error && !driver_a.fill_staged_runs ())
+	{
+		stream << "Staged fill unavailable with " << threads << " threads, keeping direct fill" << std::endl;
+	}
+	else if (!error)
+	{
+		std::array<size_t, 2> fill_durations;
+		try
+		{
+			for (auto staged : { false, true })
+			{
+				driver_a.fill_staged_set (staged);
+				auto start (std::chrono::steady_clock::now ());
+				for (unsigned i{ 0 }; i < count_a; ++i)
+				{
+					driver_a.fill ();
+				}
+				fill_durations[staged] = (std::chrono::steady_clock::now () - start).count ();
+				stream << (staged ? "Staged" : "Direct") << " fill " << nano_pow::to_megabytes (memory) << "MB average " << fill_durations[staged] * 1e-6 / count_a << "ms" << std::endl;
+			}
+			driver_a.fill_staged_set (fill_durations[true] < fill_durations[false]);
+			stream << "Found best fill " << (driver_a.fill_staged_get () ? "staged" : "direct") << std::endl;
+		}
+		catch (OCLDriverException const & err)
+		{
+			stream << "Fill comparison FAIL :: " << err.origin () << " :: " << err.what () << std::endl;
+			driver_a.fill_staged_set (false);
+		}
+	}
+
 	return error;
 }
\ No newline at end of file
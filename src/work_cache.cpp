@@ -0,0 +1,285 @@
+#include <nano_pow/pow.hpp>
+#include <nano_pow/work_cache.hpp>
+
+#include <algorithm>
+#include <exception>
+#include <iterator>
+
+void nano_pow::work_cache::signal::notify ()
+{
+	{
+		std::lock_guard<std::mutex> lock (mutex);
+		++count;
+	}
+	condition.notify_all ();
+}
+
+size_t nano_pow::work_cache::nonce_hash::operator() (std::array<uint64_t, 2> const & nonce_a) const
+{
+	// Nonces are hashes or random, mixing the two words is enough
+	return static_cast<size_t> (nonce_a[0] ^ (nonce_a[1] * 0x9e3779b97f4a7c15ULL));
+}
+
+nano_pow::work_cache::work_cache (nano_pow::work_queue & queue_a, size_t capacity_a) :
+queue (queue_a),
+capacity (std::max<size_t> (1, capacity_a))
+{
+	thread = std::thread ([this]() { run (); });
+}
+
+nano_pow::work_cache::~work_cache ()
+{
+	{
+		std::lock_guard<std::mutex> lock (mutex);
+		stopped = true;
+		for (auto & solve_l : pending)
+		{
+			queue.cancel (solve_l.nonce);
+			solve_l.cancelled = true;
+		}
+		completions->notify ();
+	}
+	thread.join ();
+}
+
+void nano_pow::work_cache::precompute (std::array<uint64_t, 2> nonce_a, nano_pow::uint128_t difficulty_a)
+{
+	std::lock_guard<std::mutex> lock (mutex);
+	auto duplicate (lookup (nonce_a, difficulty_a) != entries.end () || std::any_of (pending.begin (), pending.end (), [&nonce_a, &difficulty_a](pending_solve const & solve_a) {
+		return solve_a.nonce == nonce_a && !solve_a.cancelled && solve_a.difficulty >= difficulty_a;
+	}));
+	if (duplicate)
+	{
+		++stats.duplicates;
+	}
+	else if (!stopped)
+	{
+		++stats.precomputes;
+		pending.push_back ({ nonce_a, difficulty_a, nano_pow::work_queue::clock::time_point::max (), true, queue.push (nonce_a, difficulty_a, 0, nano_pow::work_queue::clock::time_point::max (), notifier ()).share () });
+		completions->notify ();
+	}
+}
+
+std::shared_future<std::array<uint64_t, 2>> nano_pow::work_cache::solve (std::array<uint64_t, 2> nonce_a, nano_pow::uint128_t difficulty_a, unsigned priority_a, nano_pow::work_queue::clock::time_point deadline_a, std::function<void()> complete_a)
+{
+	std::lock_guard<std::mutex> lock (mutex);
+	std::shared_future<std::array<uint64_t, 2>> result;
+	auto existing (lookup (nonce_a, difficulty_a));
+	if (existing != entries.end ())
+	{
+		++stats.hits;
+		std::promise<std::array<uint64_t, 2>> promise;
+		promise.set_value (existing->work);
+		result = promise.get_future ().share ();
+	}
+	else
+	{
+		++stats.misses;
+		if (deadline_a == nano_pow::work_queue::clock::time_point::max ())
+		{
+			auto joined (std::find_if (pending.begin (), pending.end (), [&nonce_a, &difficulty_a](pending_solve const & solve_a) {
+				return solve_a.nonce == nonce_a && !solve_a.cancelled && solve_a.difficulty >= difficulty_a && solve_a.deadline == nano_pow::work_queue::clock::time_point::max ();
+			}));
+			if (joined != pending.end ())
+			{
+				// Hints are promoted to the request's priority rather than solved again
+				queue.promote (nonce_a, priority_a + 1);
+				++joined->requesters;
+				if (complete_a)
+				{
+					joined->waiters.push_back (std::move (complete_a));
+				}
+				result = joined->result;
+			}
+		}
+		if (!result.valid ())
+		{
+			result = queue.push (nonce_a, difficulty_a, priority_a + 1, deadline_a, notifier ()).share ();
+			if (!stopped)
+			{
+				pending.push_back ({ nonce_a, difficulty_a, deadline_a, false, result, 1 });
+				if (complete_a)
+				{
+					pending.back ().waiters.push_back (std::move (complete_a));
+				}
+				completions->notify ();
+			}
+		}
+	}
+	return result;
+}
+
+bool nano_pow::work_cache::cancel (std::array<uint64_t, 2> nonce_a)
+{
+	std::lock_guard<std::mutex> lock (mutex);
+	auto released (std::find_if (pending.begin (), pending.end (), [&nonce_a](pending_solve const & solve_a) {
+		return solve_a.nonce == nonce_a && !solve_a.cancelled && solve_a.requesters > 0;
+	}));
+	auto result (released != pending.end ());
+	if (result)
+	{
+		--released->requesters;
+		auto wanted (std::any_of (pending.begin (), pending.end (), [&nonce_a](pending_solve const & solve_a) {
+			return solve_a.nonce == nonce_a && !solve_a.cancelled && (solve_a.requesters > 0 || solve_a.precompute);
+		}));
+		if (!wanted)
+		{
+			queue.cancel (nonce_a);
+			for (auto & solve_l : pending)
+			{
+				solve_l.cancelled |= solve_l.nonce == nonce_a;
+			}
+			completions->notify ();
+		}
+	}
+	return result;
+}
+
+bool nano_pow::work_cache::find (std::array<uint64_t, 2> nonce_a, nano_pow::uint128_t difficulty_a, std::array<uint64_t, 2> & work_a)
+{
+	std::lock_guard<std::mutex> lock (mutex);
+	auto existing (lookup (nonce_a, difficulty_a));
+	auto result (existing != entries.end ());
+	if (result)
+	{
+		work_a = existing->work;
+	}
+	return result;
+}
+
+size_t nano_pow::work_cache::size () const
+{
+	std::lock_guard<std::mutex> lock (mutex);
+	return entries.size ();
+}
+
+nano_pow::work_cache_stats nano_pow::work_cache::stats_get () const
+{
+	std::lock_guard<std::mutex> lock (mutex);
+	return stats;
+}
+
+void nano_pow::work_cache::run ()
+{
+	std::unique_lock<std::mutex> lock (mutex);
+	uint64_t seen{ 0 };
+	// Once stopped the pending solves are cancelled and dropped
+	while (!stopped || !pending.empty ())
+	{
+		// Solves complete out of order, each is cached once its completion is signalled and cancelled ones are dropped
+		std::vector<std::function<void()>> waiters;
+		for (auto i (pending.begin ()); i != pending.end ();)
+		{
+			if (i->cancelled)
+			{
+				std::move (i->waiters.begin (), i->waiters.end (), std::back_inserter (waiters));
+				i = pending.erase (i);
+			}
+			else if (i->result.wait_for (std::chrono::seconds (0)) == std::future_status::ready)
+			{
+				std::array<uint64_t, 2> work{ { 0, 0 } };
+				try
+				{
+					work = i->result.get ();
+				}
+				catch (std::exception const &)
+				{
+					// Failures are reported to requesters through their own future
+				}
+				auto nonce (i->nonce);
+				std::move (i->waiters.begin (), i->waiters.end (), std::back_inserter (waiters));
+				i = pending.erase (i);
+				if (work[1] != 0)
+				{
+					insert (nonce, work);
+					drop_hints (nonce);
+				}
+			}
+			else
+			{
+				++i;
+			}
+		}
+		if (!waiters.empty ())
+		{
+			// Requesters may call back into the cache
+			lock.unlock ();
+			for (auto const & waiter : waiters)
+			{
+				waiter ();
+			}
+			lock.lock ();
+		}
+		else if (!stopped || !pending.empty ())
+		{
+			lock.unlock ();
+			{
+				std::unique_lock<std::mutex> signal_lock (completions->mutex);
+				completions->condition.wait (signal_lock, [this, &seen]() { return completions->count != seen; });
+				seen = completions->count;
+			}
+			lock.lock ();
+		}
+	}
+}
+
+std::function<void()> nano_pow::work_cache::notifier () const
+{
+	// Holds the signal rather than the cache, solves may complete after it is gone
+	return [completions = completions]() { completions->notify (); };
+}
+
+void nano_pow::work_cache::drop_hints (std::array<uint64_t, 2> nonce_a)
+{
+	auto cached (index.find (nonce_a));
+	auto satisfied (cached != index.end () && std::all_of (pending.begin (), pending.end (), [&nonce_a, &cached](pending_solve const & solve_a) {
+		return solve_a.nonce != nonce_a || solve_a.cancelled || (solve_a.requesters == 0 && solve_a.difficulty <= cached->second->difficulty);
+	}));
+	// Only hints already answered by the cache are left for the nonce, cancelling them spares the queue a repeated solve
+	if (satisfied && queue.cancel (nonce_a))
+	{
+		for (auto & solve_l : pending)
+		{
+			solve_l.cancelled |= solve_l.nonce == nonce_a;
+		}
+	}
+}
+
+void nano_pow::work_cache::insert (std::array<uint64_t, 2> nonce_a, std::array<uint64_t, 2> work_a)
+{
+	auto achieved (nano_pow::difficulty (nonce_a, work_a));
+	auto existing (index.find (nonce_a));
+	if (existing != index.end ())
+	{
+		// Work already cached at a higher difficulty is kept
+		if (existing->second->difficulty < achieved)
+		{
+			existing->second->work = work_a;
+			existing->second->difficulty = achieved;
+		}
+		entries.splice (entries.begin (), entries, existing->second);
+	}
+	else
+	{
+		entries.push_front ({ nonce_a, work_a, achieved });
+		index[nonce_a] = entries.begin ();
+		if (entries.size () > capacity)
+		{
+			index.erase (entries.back ().nonce);
+			entries.pop_back ();
+			++stats.evictions;
+		}
+	}
+}
+
+std::list<nano_pow::work_cache::entry>::iterator nano_pow::work_cache::lookup (std::array<uint64_t, 2> nonce_a, nano_pow::uint128_t difficulty_a)
+{
+	auto result (entries.end ());
+	auto existing (index.find (nonce_a));
+	if (existing != index.end () && nano_pow::passes (nonce_a, existing->second->work, difficulty_a))
+	{
+		entries.splice (entries.begin (), entries, existing->second);
+		result = existing->second;
+	}
+	return result;
+}
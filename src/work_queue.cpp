@@ -0,0 +1,326 @@
+#include <nano_pow/work_queue.hpp>
+
+#include <algorithm>
+#include <exception>
+
+std::chrono::nanoseconds nano_pow::work_queue_stats::queue_mean () const
+{
+	return started != 0 ? queue_total / static_cast<std::chrono::nanoseconds::rep> (started) : std::chrono::nanoseconds (0);
+}
+
+std::chrono::nanoseconds nano_pow::work_queue_stats::service_mean () const
+{
+	return solved != 0 ? service_total / static_cast<std::chrono::nanoseconds::rep> (solved) : std::chrono::nanoseconds (0);
+}
+
+nano_pow::work_queue::work_queue (nano_pow::driver & driver_a) :
+driver (driver_a)
+{
+	dispatcher = std::thread ([this]() { run (); });
+	watchdog = std::thread ([this]() { watch (); });
+}
+
+nano_pow::work_queue::~work_queue ()
+{
+	stop ();
+}
+
+std::future<std::array<uint64_t, 2>> nano_pow::work_queue::push (std::array<uint64_t, 2> nonce_a, nano_pow::uint128_t difficulty_a, unsigned priority_a, clock::time_point deadline_a, std::function<void()> complete_a)
+{
+	auto job_l (std::make_shared<job> ());
+	job_l->nonce = nonce_a;
+	job_l->difficulty = difficulty_a;
+	job_l->priority = priority_a;
+	job_l->deadline = deadline_a;
+	job_l->pushed = clock::now ();
+	job_l->complete = std::move (complete_a);
+	auto result (job_l->promise.get_future ());
+	std::lock_guard<std::mutex> lock (mutex);
+	if (stopped)
+	{
+		job_l->promise.set_value ({ 0, 0 });
+	}
+	else
+	{
+		job_l->sequence = sequence++;
+		queue.push_back (job_l);
+		if (running != nullptr && running->priority < priority_a)
+		{
+			preempt = true;
+		}
+		condition.notify_all ();
+	}
+	return result;
+}
+
+bool nano_pow::work_queue::cancel (std::array<uint64_t, 2> nonce_a)
+{
+	std::lock_guard<std::mutex> lock (mutex);
+	bool result{ false };
+	for (auto i (queue.begin ()); i != queue.end ();)
+	{
+		if ((*i)->nonce == nonce_a)
+		{
+			++stats[(*i)->priority].cancelled;
+			(*i)->promise.set_value ({ 0, 0 });
+			completed (**i);
+			i = queue.erase (i);
+			result = true;
+		}
+		else
+		{
+			++i;
+		}
+	}
+	if (running != nullptr && running->nonce == nonce_a)
+	{
+		running->cancelled = true;
+		condition.notify_all ();
+		result = true;
+	}
+	return result;
+}
+
+bool nano_pow::work_queue::promote (std::array<uint64_t, 2> nonce_a, unsigned priority_a)
+{
+	std::lock_guard<std::mutex> lock (mutex);
+	bool result{ false };
+	if (running != nullptr && running->nonce == nonce_a)
+	{
+		running->priority = std::max (running->priority, priority_a);
+		result = true;
+	}
+	for (auto const & job_l : queue)
+	{
+		if (job_l->nonce == nonce_a)
+		{
+			job_l->priority = std::max (job_l->priority, priority_a);
+			preempt = preempt || (running != nullptr && running->priority < job_l->priority);
+			result = true;
+		}
+	}
+	condition.notify_all ();
+	return result;
+}
+
+void nano_pow::work_queue::stop ()
+{
+	{
+		std::lock_guard<std::mutex> lock (mutex);
+		stopped = true;
+		condition.notify_all ();
+	}
+	if (dispatcher.joinable ())
+	{
+		dispatcher.join ();
+	}
+	if (watchdog.joinable ())
+	{
+		watchdog.join ();
+	}
+}
+
+size_t nano_pow::work_queue::size () const
+{
+	std::lock_guard<std::mutex> lock (mutex);
+	return queue.size () + (running != nullptr ? 1 : 0);
+}
+
+std::map<unsigned, nano_pow::work_queue_stats> nano_pow::work_queue::stats_get () const
+{
+	std::lock_guard<std::mutex> lock (mutex);
+	return stats;
+}
+
+std::shared_ptr<nano_pow::work_queue::job> nano_pow::work_queue::pop ()
+{
+	auto best (std::min_element (queue.begin (), queue.end (), [](std::shared_ptr<job> const & lhs, std::shared_ptr<job> const & rhs) {
+		if (lhs->priority != rhs->priority)
+		{
+			return lhs->priority > rhs->priority;
+		}
+		if (lhs->deadline != rhs->deadline)
+		{
+			return lhs->deadline < rhs->deadline;
+		}
+		return lhs->sequence < rhs->sequence;
+	}));
+	auto result (*best);
+	queue.erase (best);
+	return result;
+}
+
+void nano_pow::work_queue::finish (job & job_a, std::array<uint64_t, 2> const & result_a)
+{
+	auto & stats_l (stats[job_a.priority]);
+	if (result_a[1] != 0)
+	{
+		auto service (std::chrono::duration_cast<std::chrono::nanoseconds> (clock::now () - job_a.pushed));
+		++stats_l.solved;
+		stats_l.service_total += service;
+		stats_l.service_max = std::max (stats_l.service_max, service);
+	}
+	else if (job_a.cancelled || stopped)
+	{
+		++stats_l.cancelled;
+	}
+	else if (clock::now () >= job_a.deadline)
+	{
+		++stats_l.expired;
+	}
+	else
+	{
+		++stats_l.failed;
+	}
+	job_a.promise.set_value (result_a);
+	completed (job_a);
+}
+
+void nano_pow::work_queue::completed (job & job_a)
+{
+	if (job_a.complete)
+	{
+		completions.push_back (std::move (job_a.complete));
+		condition.notify_all ();
+	}
+}
+
+bool nano_pow::work_queue::notify (std::unique_lock<std::mutex> & lock_a)
+{
+	auto result (!completions.empty ());
+	// Callbacks may call back into the queue or take locks held while calling it
+	while (!completions.empty ())
+	{
+		auto completions_l (std::move (completions));
+		completions.clear ();
+		lock_a.unlock ();
+		for (auto const & complete_l : completions_l)
+		{
+			complete_l ();
+		}
+		lock_a.lock ();
+	}
+	return result;
+}
+
+void nano_pow::work_queue::run ()
+{
+	std::unique_lock<std::mutex> lock (mutex);
+	while (!stopped)
+	{
+		if (notify (lock))
+		{
+			// The state may have changed while unlocked
+			continue;
+		}
+		auto now (clock::now ());
+		for (auto i (queue.begin ()); i != queue.end ();)
+		{
+			if ((*i)->deadline <= now)
+			{
+				finish (**i, { 0, 0 });
+				i = queue.erase (i);
+			}
+			else
+			{
+				++i;
+			}
+		}
+		if (queue.empty ())
+		{
+			condition.wait (lock);
+		}
+		else
+		{
+			auto job_l (pop ());
+			if (!job_l->started)
+			{
+				auto waited (std::chrono::duration_cast<std::chrono::nanoseconds> (now - job_l->pushed));
+				auto & stats_l (stats[job_l->priority]);
+				job_l->started = true;
+				++stats_l.started;
+				stats_l.queue_total += waited;
+				stats_l.queue_max = std::max (stats_l.queue_max, waited);
+			}
+			running = job_l;
+			running_token = driver.solve_token ();
+			preempt = false;
+			condition.notify_all ();
+			lock.unlock ();
+			std::array<uint64_t, 2> result{ { 0, 0 } };
+			nano_pow::solve_progress progress;
+			std::exception_ptr error;
+			try
+			{
+				driver.difficulty_set (job_l->difficulty);
+				result = job_l->progress.entries != 0 ? driver.resume (job_l->nonce, job_l->progress) : driver.solve (job_l->nonce);
+				progress = driver.progress_get ();
+			}
+			catch (...)
+			{
+				error = std::current_exception ();
+			}
+			lock.lock ();
+			running = nullptr;
+			condition.notify_all ();
+			if (error)
+			{
+				++stats[job_l->priority].failed;
+				job_l->promise.set_exception (error);
+				completed (*job_l);
+			}
+			else if (result[1] == 0 && preempt && !job_l->cancelled && !stopped && clock::now () < job_l->deadline)
+			{
+				++stats[job_l->priority].preempted;
+				job_l->progress = progress;
+				queue.push_back (job_l);
+			}
+			else
+			{
+				finish (*job_l, result);
+			}
+		}
+	}
+	for (auto const & job_l : queue)
+	{
+		finish (*job_l, { 0, 0 });
+	}
+	queue.clear ();
+	notify (lock);
+}
+
+void nano_pow::work_queue::watch ()
+{
+	std::unique_lock<std::mutex> lock (mutex);
+	// Cancels the running job after stopping too, until the dispatcher is done with it
+	uint64_t cancelled_token{ 0 };
+	while (!stopped || running != nullptr)
+	{
+		if (notify (lock))
+		{
+			continue;
+		}
+		if (running == nullptr)
+		{
+			condition.wait (lock);
+		}
+		else if (stopped || preempt || running->cancelled || clock::now () >= running->deadline)
+		{
+			// The token names the job's solve, so cancelling before it starts is enough
+			if (cancelled_token != running_token)
+			{
+				driver.cancel_solve (running_token);
+				cancelled_token = running_token;
+			}
+			condition.wait (lock);
+		}
+		else if (running->deadline != clock::time_point::max ())
+		{
+			condition.wait_until (lock, running->deadline);
+		}
+		else
+		{
+			condition.wait (lock);
+		}
+	}
+}